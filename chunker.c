@@ -1,14 +1,32 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <linux/fs.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/loop.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 // dd, but better
 
@@ -31,37 +49,135 @@ static const char * const type_strings[] = {
 };
 static const char * const rw_strings[] = {"reading", "writing"};
 
+#define ENGINE_SYNC   0
+#define ENGINE_URING  1
+#define ENGINE_PIPE   2
+
+static const char * const engine_strings[] = {
+    "sync",
+    "uring",
+    "pipeline"
+};
+#define N_ENGINES (int)(sizeof(engine_strings) / sizeof(engine_strings[0]))
+
+#define HASH_NONE    0
+#define HASH_CRC32C  1
+#define HASH_XXH64   2
+#define HASH_SHA256  3
+
+static const char * const hash_strings[] = {
+    "none",
+    "crc32c",
+    "xxh64",
+    "sha256"
+};
+#define N_HASHES (int)(sizeof(hash_strings) / sizeof(hash_strings[0]))
+
+#define CODEC_STORED  0
+#define CODEC_LZ4     1
+#define CODEC_ZSTD    2
+#define CODEC_INDEX   3
+
+static const char * const codec_strings[] = {
+    "stored",
+    "lz4",
+    "zstd"
+};
+#define N_CODECS (int)(sizeof(codec_strings) / sizeof(codec_strings[0]))
+
+#define MAX_CHUNK  (16 * 1024 * 1024)
+
+typedef struct StreamStats StreamStats;
+
 typedef struct {
     int fd;
     int type;
     char *name;
     int64_t size;
+    _Atomic int64_t written;
+    bool direct;
+    int lbs;
+    int pbs;
+    char *scratch;
+    int scratch_len;
+    int64_t *wb_offs;
+    int *wb_lens;
+    int wb_count;
+    StreamStats *stats;
 } Stream;
 
+typedef struct HashState HashState;
+
 typedef struct {
     Stream *streams;
     int n_streams;
+    int n_inputs;
+    int cur_input;
     int finished_fd;
     int64_t chunksize;
     int64_t chunkcount;
     int64_t totalsize;
+    int engine;
+    int queue_depth;
+    int ring_size;
+    int64_t lag;
     bool nosync;
     bool noprogress;
     bool noconfirm;
     bool noautochunk;
+    bool nozerocopy;
+    bool direct;
+    int align;
+    int sector;
+    bool sparse;
+    bool diffwrite;
+    bool stripe;
+    int compress;
+    bool decompress;
+    int jobs;
+    int syncwindow;
+    char *chunkcache;
+    char *journal;
+    int64_t resume;
+    char *rescue;
+    char *stats;
+    char *statsstream;
+    HashState *hash;
+    char *zeros;
 } Settings;
 
 char *get_string_element(char **args, int count, int idx);
 int64_t get_int64_element_or(char **args, int count, int idx, int64_t sentinel);
 int64_t get_size_element(char **args, int count, int idx);
 
+void format_size(char *size_buf, int max_len, int64_t n);
+HashState *make_hash_state(int algo, bool verify);
+void hash_setup(void);
+int print_hash_results(Settings *s, FILE *output);
+int64_t journal_load(Settings *s, FILE *output);
+bool rescue_map_valid(Settings *s);
+int64_t now_ns(void);
+void telemetry_start(Settings *s);
+void stats_tick(Settings *s, FILE *f);
+void write_stats_summary(Settings *s, FILE *f);
+const char *base_name(const char *path);
 void print_stream_info(Stream *s, FILE *output);
+bool uring_available(void);
 void *copy_data(void *args);
+void print_totals(Settings *s, bool verify, FILE *output);
+int run_bench(int argc, char **argv);
 
 static _Atomic int64_t bytes_read = 0;
 static _Atomic int64_t bytes_written = 0;
+static _Atomic int64_t bytes_skipped = 0;
+static _Atomic int64_t bytes_unchanged = 0;
+static _Atomic int64_t bytes_verified = 0;
+static _Atomic int64_t bad_frames = 0;
+static _Atomic int64_t bytes_unreadable = 0;
 static _Atomic int64_t total_bytes = 0;
 static _Atomic int64_t cancelled = 0;
+static bool telemetry = false;
+static const char *copy_method = "";
 
 void print_help(FILE *output)
 {
@@ -75,6 +191,12 @@ void print_help(FILE *output)
         "     Adds an output file\n"
         "  -ifd <input file descriptor integer>\n"
         "     Overrides -i\n"
+        "  -concat\n"
+        "     Each -i adds an input instead of replacing the last one, and the inputs are copied one after the other.\n"
+        "     With -jobs, every input is copied at once to its own place in the outputs\n"
+        "  -stripe\n"
+        "     Send each chunk to one output only, taking turns between them like RAID0. The stripe size is -chunksize\n"
+        "     (default 1M). Uses -engine pipeline, so each output is written on its own thread\n"
         "  -ofd <output file descriptor integer>\n"
         "     Adds an output descriptor\n"
         "  -chunksize <size specifier>\n"
@@ -83,22 +205,94 @@ void print_help(FILE *output)
         "     Number of chunks to copy. Requires -chunksize, and not -noautochunk\n"
         "  -totalsize <size specifier>\n"
         "     Overrides -chunkcount\n"
+        "  -hash <crc32c|xxh64|sha256>\n"
+        "     Checksum the input on separate threads while it is copied, and print the result at the end.\n"
+        "     Uses -engine pipeline\n"
+        "  -verify\n"
+        "     Once the copy is finished, read back every output file or block device and compare it\n"
+        "     with the input, one chunk at a time. Uses -hash xxh64 unless -hash is given\n"
+        "  -rescue <map file>\n"
+        "     Copy from a failing drive. Read errors skip further and further ahead, and the parts that were skipped\n"
+        "     or failed are retried afterwards with smaller and smaller blocks. Progress is kept in the map file,\n"
+        "     which lets the rescue carry on later. The input and every output must be files or block devices\n"
+        "  -compress <lz4|zstd>\n"
+        "     Compress the input into independent frames on a thread per CPU, followed by an index of the frames.\n"
+        "     Each frame holds one chunk. zstd is only available when built with HAVE_ZSTD. Uses -engine pipeline\n"
+        "  -decompress\n"
+        "     Turn a stream made by -compress back into the original data. With -jobs, a compressed file\n"
+        "     is decompressed by every worker at once using its index. Otherwise uses -engine pipeline\n"
         "  -nosync\n"
         "     Don't sync after each copy\n"
+        "  -syncwindow <count>\n"
+        "     Instead of syncing after each chunk, start writing each chunk back straight away\n"
+        "     and only wait for the chunk from this many chunks ago. Everything is still synced at the end\n"
         "  -noprogress\n"
         "     Don't print the current progress\n"
+        "  -stats <file>\n"
+        "     Time every read, write and sync, and write a JSON summary to this file at the end: throughput,\n"
+        "     latency histograms and time spent waiting on the other side of the copy for each stream,\n"
+        "     and the chunk sizes the tuner picked over time\n"
+        "  -statsstream <file>\n"
+        "     Write a line of JSON with the current throughput, wait time and p99 latencies of each stream to this file every second\n"
         "  -noconfirm\n"
         "     Don't show input and output metadata and prompt before copying\n"
         "  -noautochunk\n"
-        "     When not using -chunksize, don't grow the chunk size after successive chunks\n"
+        "     When not using -chunksize, don't tune the chunk size after successive chunks\n"
+        "  -chunkcache <file>\n"
+        "     Remember the best chunk size found for each pair of devices in this file, and start from it next time\n"
+        "  -journal <file>\n"
+        "     Record how far the copy has been synced in this file every so often. If the file already exists,\n"
+        "     check that the input and outputs still match it and carry on from there. Deleted once the copy finishes.\n"
+        "     The input and every output must be files or block devices. Uses -engine sync\n"
+        "  -jobs <count>\n"
+        "     Split the copy into ranges which are copied by this many threads at once.\n"
+        "     The input and every output must be files or block devices\n"
+        "  -direct\n"
+        "     Open files and block devices with O_DIRECT, so that the copy doesn't go through the page cache.\n"
+        "     Chunk sizes are rounded to the sector size. Implies -nozerocopy\n"
+        "  -sparse\n"
+        "     Don't read holes in the input, and leave holes in output files in place of chunks of zeros.\n"
+        "     Implies -nozerocopy\n"
+        "  -diffwrite\n"
+        "     Read back each chunk from file and block device outputs first, and only write the parts that differ.\n"
+        "     Implies -nozerocopy\n"
+        "  -nozerocopy\n"
+        "     Always copy through a buffer, even when the kernel could move the data by itself.\n"
+        "     Implied by -engine\n"
+        "  -engine <sync|uring|pipeline>\n"
+        "     How to move data. sync (default) does one read then one write at a time,\n"
+        "     uring keeps several reads and writes in flight through io_uring,\n"
+        "     pipeline reads on one thread and writes each output on its own thread\n"
+        "  -qd <count>\n"
+        "     Number of chunks in flight with -engine uring (default 8)\n"
+        "  -ring <count>\n"
+        "     Number of chunk buffers shared between threads with -engine pipeline (default 8)\n"
+        "  -lag <size specifier>\n"
+        "     How far the slowest output may fall behind the input with -engine pipeline. Overrides -ring\n"
+        "When there is more than one output, -engine pipeline is used unless another engine is given\n"
+        "\n"
+        "Usage: chunker -bench <directory> [-totalsize <size specifier>] [-runs <count>] [-loop]\n"
+        "  Time copies of a file made in the directory (default 64M) with each engine, chunk size, sync policy\n"
+        "  and one or two outputs, alongside dd doing the same, and print the results as CSV.\n"
+        "  Each configuration is run 3 times by default. -loop runs everything again through loop devices\n"
     );
 }
 
 int main(int argc, char **argv)
 {
+    if (argc > 1 && !strcmp(argv[1], "-bench"))
+        return run_bench(argc, argv);
+
     Settings s = {0};
     s.streams = calloc((argc / 2) + 1, sizeof(Stream));
     bool any_input = false;
+    bool any_engine = false;
+    bool any_ifd = false;
+    bool concat = false;
+    char **input_names = calloc(argc, sizeof(char*));
+    int n_input_names = 0;
+    int hash_algo = HASH_NONE;
+    bool verify = false;
 
     int console_outputs = 0;
     FILE *pf = stdout;
@@ -108,8 +302,10 @@ int main(int argc, char **argv)
         if (!strcmp(argv[i], "-i")) {
             s.streams[0].name = get_string_element(argv, argc, i+1);
             invalid = s.streams[0].name == NULL;
-            if (!invalid)
+            if (!invalid) {
                 any_input = true;
+                input_names[n_input_names++] = s.streams[0].name;
+            }
         }
         else if (!strcmp(argv[i], "-o")) {
             char *output_file = get_string_element(argv, argc, i+1);
@@ -122,6 +318,7 @@ int main(int argc, char **argv)
             invalid = fd == -1;
             if (!invalid) {
                 any_input = true;
+                any_ifd = true;
                 s.streams[0].name = (char*)(fd + 1LL);
             }
         }
@@ -151,6 +348,82 @@ int main(int argc, char **argv)
             s.totalsize = get_size_element(argv, argc, i+1);
             invalid = s.totalsize <= 0;
         }
+        else if (!strcmp(argv[i], "-engine")) {
+            char *name = get_string_element(argv, argc, i+1);
+            s.engine = -1;
+            for (int j = 0; name && j < N_ENGINES; j++) {
+                if (!strcmp(name, engine_strings[j]))
+                    s.engine = j;
+            }
+            invalid = s.engine < 0;
+            any_engine = true;
+        }
+        else if (!strcmp(argv[i], "-qd")) {
+            s.queue_depth = (int)get_int64_element_or(argv, argc, i+1, -1);
+            invalid = s.queue_depth <= 0;
+        }
+        else if (!strcmp(argv[i], "-ring")) {
+            s.ring_size = (int)get_int64_element_or(argv, argc, i+1, -1);
+            invalid = s.ring_size <= 0;
+        }
+        else if (!strcmp(argv[i], "-lag")) {
+            s.lag = get_size_element(argv, argc, i+1);
+            invalid = s.lag <= 0;
+        }
+        else if (!strcmp(argv[i], "-jobs")) {
+            s.jobs = (int)get_int64_element_or(argv, argc, i+1, -1);
+            invalid = s.jobs <= 0;
+        }
+        else if (!strcmp(argv[i], "-syncwindow")) {
+            s.syncwindow = (int)get_int64_element_or(argv, argc, i+1, -1);
+            invalid = s.syncwindow <= 0;
+        }
+        else if (!strcmp(argv[i], "-chunkcache")) {
+            s.chunkcache = get_string_element(argv, argc, i+1);
+            invalid = s.chunkcache == NULL;
+        }
+        else if (!strcmp(argv[i], "-journal")) {
+            s.journal = get_string_element(argv, argc, i+1);
+            invalid = s.journal == NULL;
+        }
+        else if (!strcmp(argv[i], "-rescue")) {
+            s.rescue = get_string_element(argv, argc, i+1);
+            invalid = s.rescue == NULL;
+        }
+        else if (!strcmp(argv[i], "-stats")) {
+            s.stats = get_string_element(argv, argc, i+1);
+            invalid = s.stats == NULL;
+        }
+        else if (!strcmp(argv[i], "-statsstream")) {
+            s.statsstream = get_string_element(argv, argc, i+1);
+            invalid = s.statsstream == NULL;
+        }
+        else if (!strcmp(argv[i], "-hash")) {
+            char *name = get_string_element(argv, argc, i+1);
+            hash_algo = -1;
+            for (int j = 1; name && j < N_HASHES; j++) {
+                if (!strcmp(name, hash_strings[j]))
+                    hash_algo = j;
+            }
+            invalid = hash_algo < 0;
+        }
+        else if (!strcmp(argv[i], "-compress")) {
+            char *name = get_string_element(argv, argc, i+1);
+            s.compress = -1;
+            for (int j = 1; name && j < N_CODECS; j++) {
+                if (!strcmp(name, codec_strings[j]))
+                    s.compress = j;
+            }
+            invalid = s.compress < 0;
+        }
+        else if (!strcmp(argv[i], "-decompress")) {
+            s.decompress = true;
+            i--;
+        }
+        else if (!strcmp(argv[i], "-verify")) {
+            verify = true;
+            i--;
+        }
         else if (!strcmp(argv[i], "-nosync")) {
             s.nosync = true;
             i--;
@@ -167,6 +440,30 @@ int main(int argc, char **argv)
             s.noautochunk = true;
             i--;
         }
+        else if (!strcmp(argv[i], "-direct")) {
+            s.direct = true;
+            i--;
+        }
+        else if (!strcmp(argv[i], "-sparse")) {
+            s.sparse = true;
+            i--;
+        }
+        else if (!strcmp(argv[i], "-diffwrite")) {
+            s.diffwrite = true;
+            i--;
+        }
+        else if (!strcmp(argv[i], "-concat")) {
+            concat = true;
+            i--;
+        }
+        else if (!strcmp(argv[i], "-stripe")) {
+            s.stripe = true;
+            i--;
+        }
+        else if (!strcmp(argv[i], "-nozerocopy")) {
+            s.nozerocopy = true;
+            i--;
+        }
         else {
             i--;
         }
@@ -180,6 +477,22 @@ int main(int argc, char **argv)
     if (any_input)
         s.n_streams++;
 
+    // The inputs after the first go after the outputs, so that everything which only deals with outputs stays the same
+    s.n_inputs = 1;
+    if (concat) {
+        if (any_ifd) {
+            fprintf(pf, "-concat takes its inputs from -i, not -ifd\n");
+            return 2;
+        }
+        if (n_input_names > 0) {
+            s.streams[0].name = input_names[0];
+            for (int k = 1; k < n_input_names; k++)
+                s.streams[s.n_streams + k - 1].name = input_names[k];
+            s.n_inputs = n_input_names;
+        }
+    }
+    free(input_names);
+
     if (s.n_streams < 2) {
         print_help(pf);
         return 1;
@@ -202,11 +515,99 @@ int main(int argc, char **argv)
         s.noautochunk = true;
     }
 
-    for (int i = 0; i < s.n_streams; i++) {
+    // Writing every output from the one thread means the slowest output holds up all the others
+    if (!any_engine && s.n_streams > 2)
+        s.engine = ENGINE_PIPE;
+
+    if (verify && hash_algo == HASH_NONE)
+        hash_algo = HASH_XXH64;
+
+    if (hash_algo != HASH_NONE) {
+        if (s.engine == ENGINE_URING || s.jobs > 1) {
+            fprintf(pf, "-hash and -verify can't be used with -engine uring or -jobs\n");
+            return 2;
+        }
+        hash_setup();
+        s.hash = make_hash_state(hash_algo, verify);
+        s.engine = ENGINE_PIPE;
+    }
+
+    // Resuming relies on each chunk being synced to every output before the next one is read
+    if (s.journal) {
+        if ((any_engine && s.engine != ENGINE_SYNC) || s.jobs > 1 || s.hash) {
+            fprintf(pf, "-journal can only be used with -engine sync, and not with -jobs, -hash or -verify\n");
+            return 2;
+        }
+        s.engine = ENGINE_SYNC;
+    }
+
+    if (s.stripe) {
+        if ((any_engine && s.engine != ENGINE_PIPE) || s.jobs > 1 || s.journal || verify) {
+            fprintf(pf, "-stripe can only be used with -engine pipeline, and not with -jobs, -journal or -verify\n");
+            return 2;
+        }
+        s.engine = ENGINE_PIPE;
+    }
+
+    if (s.compress || s.decompress) {
+#ifndef HAVE_ZSTD
+        if (s.compress == CODEC_ZSTD) {
+            fprintf(pf, "chunker was built without zstd, use -compress lz4 instead\n");
+            return 2;
+        }
+#endif
+        if (s.compress && s.decompress) {
+            fprintf(pf, "-compress and -decompress can't be used together\n");
+            return 2;
+        }
+        if ((any_engine && s.engine != ENGINE_PIPE) || s.stripe || s.journal || verify) {
+            fprintf(pf, "-compress and -decompress can only be used with -engine pipeline, and not with -stripe, -journal or -verify\n");
+            return 2;
+        }
+        if (s.compress && s.jobs > 1) {
+            fprintf(pf, "-compress can't be used with -jobs\n");
+            return 2;
+        }
+        if (s.decompress && (s.hash || concat)) {
+            fprintf(pf, "-decompress can't be used with -hash or -concat\n");
+            return 2;
+        }
+        hash_setup();
+        s.engine = ENGINE_PIPE;
+    }
+
+    if (s.rescue) {
+        if (any_engine || s.jobs > 1 || s.journal || s.hash || s.stripe || s.compress || s.decompress || s.n_inputs > 1) {
+            fprintf(pf, "-rescue can't be used with -engine, -jobs, -journal, -hash, -verify, -stripe, -concat, -compress or -decompress\n");
+            return 2;
+        }
+        s.engine = ENGINE_SYNC;
+    }
+
+    if (s.n_inputs > 1 && (s.engine == ENGINE_URING || s.journal)) {
+        fprintf(pf, "-concat can't be used with -engine uring or -journal\n");
+        return 2;
+    }
+
+    if (any_engine || s.direct || s.sparse || s.diffwrite || s.hash || s.journal || s.stripe || s.n_inputs > 1 || s.compress || s.decompress || s.rescue)
+        s.nozerocopy = true;
+
+    if ((s.sparse || s.diffwrite) && s.engine == ENGINE_URING) {
+        fprintf(pf, "-sparse and -diffwrite can't be used with -engine uring\n");
+        return 2;
+    }
+
+    if (s.engine == ENGINE_URING && !uring_available()) {
+        fprintf(pf, "io_uring is not available, using the sync engine instead\n");
+        s.engine = ENGINE_SYNC;
+    }
+
+    for (int i = 0; i < s.n_streams + s.n_inputs - 1; i++) {
+        bool input = i == 0 || i >= s.n_streams;
         if ((uint64_t)s.streams[i].name <= 3ULL) {
             int64_t fd = (int64_t)s.streams[i].name - 1LL;
-            if (i == 0) {
-                if (fd == STDOUT_FILENO) {
+            if (input) {
+                if (fd == STDIN_FILENO) {
                     if (!s.noconfirm) {
                         fprintf(pf, "Cannot read from stdin and ask for user input, pass -noconfirm instead\n");
                         return 2;
@@ -243,10 +644,17 @@ int main(int argc, char **argv)
             do {
                 is_link = false;
 
-                int flags = i == 0 ? O_RDONLY : O_RDWR;
-                int fd = open(s.streams[i].name, flags);
+                int flags = input ? O_RDONLY : O_RDWR;
+                int fd = -1;
+                if (s.direct) {
+                    // Not every filesystem supports O_DIRECT, in which case that stream just uses the page cache
+                    fd = open(s.streams[i].name, flags | O_DIRECT);
+                    s.streams[i].direct = fd >= 0;
+                }
+                if (fd < 0)
+                    fd = open(s.streams[i].name, flags);
                 if (fd < 0) {
-                    fprintf(pf, "Could not open \"%s\" for %s\n", s.streams[i].name, rw_strings[i > 0]);
+                    fprintf(pf, "Could not open \"%s\" for %s\n", s.streams[i].name, rw_strings[!input]);
                     return 2;
                 }
                 s.streams[i].fd = fd;
@@ -273,6 +681,13 @@ int main(int argc, char **argv)
                     {
                         s.streams[i].type = TYPE_REG;
                         s.streams[i].size = st.st_size;
+                        s.streams[i].lbs = 4096;
+                        s.streams[i].pbs = st.st_blksize > 0 ? (int)st.st_blksize : 4096;
+#ifdef STATX_DIOALIGN
+                        struct statx stx = {0};
+                        if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0)
+                            s.streams[i].lbs = (int)stx.stx_dio_offset_align;
+#endif
                         break;
                     }
                     case S_IFBLK:
@@ -281,6 +696,13 @@ int main(int argc, char **argv)
                         uint64_t block_size;
                         int rc = ioctl(fd, BLKGETSIZE64, &block_size);
                         s.streams[i].size = (int64_t)block_size;
+
+                        int lbs = 512;
+                        unsigned int pbs = 512;
+                        ioctl(fd, BLKSSZGET, &lbs);
+                        ioctl(fd, BLKPBSZGET, &pbs);
+                        s.streams[i].lbs = lbs;
+                        s.streams[i].pbs = (int)pbs;
                         break;
                     }
                     case S_IFCHR:
@@ -310,11 +732,70 @@ int main(int argc, char **argv)
             }
             while (is_link);
         }
+
+        // Buffers and transfer sizes have to line up with the largest sector size of any stream opened with O_DIRECT
+        if (s.streams[i].direct) {
+            if (s.streams[i].lbs > s.align)
+                s.align = s.streams[i].lbs;
+            if (s.streams[i].pbs > s.sector)
+                s.sector = s.streams[i].pbs;
+        }
+    }
+    if (s.sector < s.align)
+        s.sector = s.align;
+
+    if (s.jobs > 1) {
+        bool seekable = s.totalsize > 0 || s.streams[0].size > 0;
+        for (int i = 0; i < s.n_streams + s.n_inputs - 1; i++)
+            seekable = seekable && (s.streams[i].type == TYPE_REG || s.streams[i].type == TYPE_BLOCK);
+        if (!seekable) {
+            fprintf(pf, "-jobs needs the input and every output to be a file or block device, and the size to be known\n");
+            return 2;
+        }
+        if (any_engine) {
+            fprintf(pf, "-jobs can't be used with -engine\n");
+            return 2;
+        }
+    }
+
+    if (s.journal) {
+        for (int i = 0; i < s.n_streams; i++) {
+            if (s.streams[i].type != TYPE_REG && s.streams[i].type != TYPE_BLOCK) {
+                fprintf(pf, "-journal needs the input and every output to be a file or block device\n");
+                return 2;
+            }
+        }
+        hash_setup();
+        s.resume = journal_load(&s, pf);
+        if (s.resume < 0)
+            return 2;
+        if (s.resume > 0) {
+            for (int i = 0; i < s.n_streams; i++)
+                lseek(s.streams[i].fd, s.resume, SEEK_SET);
+            char size_buf[64];
+            format_size(size_buf, 64, s.resume);
+            fprintf(pf, "Resuming from offset %ld (%s) recorded in %s\n", s.resume, size_buf, s.journal);
+        }
+    }
+
+    if (s.rescue) {
+        for (int i = 0; i < s.n_streams; i++) {
+            if (s.streams[i].type != TYPE_REG && s.streams[i].type != TYPE_BLOCK) {
+                fprintf(pf, "-rescue needs the input and every output to be a file or block device\n");
+                return 2;
+            }
+        }
+        if (!rescue_map_valid(&s)) {
+            fprintf(pf, "The map %s was made for an input of a different size\n", s.rescue);
+            return 2;
+        }
     }
 
     if (!s.noconfirm) {
         fprintf(pf, "Copying from\n");
         print_stream_info(&s.streams[0], pf);
+        for (int i = s.n_streams; i < s.n_streams + s.n_inputs - 1; i++)
+            print_stream_info(&s.streams[i], pf);
         fprintf(pf, "To\n");
 
         int n_named_outputs = 0;
@@ -362,7 +843,20 @@ int main(int argc, char **argv)
         }
     }
 
-    if (!s.noprogress) {
+    FILE *stats_file = NULL, *stats_stream = NULL;
+    if (s.stats && !(stats_file = fopen(s.stats, "w"))) {
+        fprintf(pf, "Could not open \"%s\" for writing\n", s.stats);
+        return 2;
+    }
+    if (s.statsstream && !(stats_stream = fopen(s.statsstream, "w"))) {
+        fprintf(pf, "Could not open \"%s\" for writing\n", s.statsstream);
+        return 2;
+    }
+    if (stats_file || stats_stream)
+        telemetry_start(&s);
+
+    // The progress thread also keeps the running throughput figures for the stats
+    if (!s.noprogress || telemetry) {
         int cancel_fds[2] = {0};
         if (pipe(cancel_fds) < 0) {
             fprintf(pf, "Failed to create communication pipe\n");
@@ -384,9 +878,43 @@ int main(int argc, char **argv)
         pthread_t tid;
         pthread_create(&tid, NULL, copy_data, settings_copy);
 
+        int64_t *last_written = calloc(s.n_streams, sizeof(int64_t));
+        struct timespec t1 = {0}, t2 = {0};
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
         while (true) {
-            select(1, &fds, NULL, NULL, &tv);
-            fprintf(pf, "\x1b[G%ld bytes transferred", bytes_written);
+            select(cancel_fds[0] + 1, &fds, NULL, NULL, &tv);
+            if (telemetry)
+                stats_tick(&s, stats_stream);
+            if (s.noprogress) {
+                if (cancelled)
+                    break;
+                FD_ZERO(&fds);
+                FD_SET(cancel_fds[0], &fds);
+                tv.tv_sec = 1;
+                tv.tv_usec = 0;
+                continue;
+            }
+
+            fprintf(pf, "\x1b[G");
+            print_totals(&s, verify, pf);
+
+            if (s.n_streams > 2) {
+                clock_gettime(CLOCK_MONOTONIC, &t2);
+                double secs = (double)(t2.tv_sec - t1.tv_sec) + (double)(t2.tv_nsec - t1.tv_nsec) / 1e9;
+                t1 = t2;
+
+                for (int i = 1; i < s.n_streams; i++) {
+                    int64_t w = s.streams[i].written;
+                    char size_buf[64];
+                    format_size(size_buf, 64, secs > 0.0 ? (int64_t)((double)(w - last_written[i]) / secs) : 0);
+                    fprintf(pf, " | %s %s/s", base_name(s.streams[i].name), size_buf);
+                    last_written[i] = w;
+                }
+                fprintf(pf, "\x1b[K");
+            }
+            fflush(pf);
+
             if (cancelled) {
                 break;
             }
@@ -396,12 +924,51 @@ int main(int argc, char **argv)
             tv.tv_sec = 1;
             tv.tv_usec = 0;
         }
-        putchar('\n');
+        if (!s.noprogress)
+            putchar('\n');
+        free(last_written);
     }
     else {
         copy_data(&s);
-        fprintf(pf, "%ld bytes transferred\n", bytes_written);
     }
+    if (s.noprogress) {
+        print_totals(&s, verify, pf);
+        fprintf(pf, "\n");
+    }
+
+    if (stats_stream)
+        fclose(stats_stream);
+    if (stats_file) {
+        write_stats_summary(&s, stats_file);
+        fclose(stats_file);
+    }
+
+    if (s.hash && print_hash_results(&s, pf) > 0)
+        return 5;
+    if (s.rescue && bytes_unreadable > 0) {
+        fprintf(pf, "%ld bytes could not be read, see %s\n", bytes_unreadable, s.rescue);
+        return 5;
+    }
+    if (bad_frames > 0) {
+        fprintf(pf, "%ld frame%s could not be decompressed\n", bad_frames, bad_frames == 1 ? "" : "s");
+        return 5;
+    }
+    return 0;
+}
+
+void print_totals(Settings *s, bool verify, FILE *output)
+{
+    fprintf(output, "%ld bytes transferred", bytes_written);
+    if (s->sparse)
+        fprintf(output, ", %ld bytes skipped", bytes_skipped);
+    if (s->diffwrite)
+        fprintf(output, ", %ld bytes unchanged", bytes_unchanged);
+    if (verify)
+        fprintf(output, ", %ld bytes verified", bytes_verified);
+    if (s->compress || s->decompress)
+        fprintf(output, ", %ld bytes read", bytes_read);
+    if (s->rescue)
+        fprintf(output, ", %ld bytes unreadable", bytes_unreadable);
 }
 
 char *get_string_element(char **args, int count, int idx)
@@ -439,7 +1006,12 @@ int64_t get_size_element(char **args, int count, int idx)
                 return -1;
             spec = c;
         }
-        n = n * 10LL + (int64_t)(c - '0');
+        else if (spec) {
+            return -1;
+        }
+        else {
+            n = n * 10LL + (int64_t)(c - '0');
+        }
     }
 
     switch (spec) {
@@ -494,6 +1066,12 @@ void format_size(char *size_buf, int max_len, int64_t n)
         off += snprintf(&size_buf[off], max_len - off, "%c", "KMGT"[cuts-1]);
 }
 
+const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
 void print_stream_info(Stream *s, FILE *output)
 {
     char size_buf[64];
@@ -501,94 +1079,4074 @@ void print_stream_info(Stream *s, FILE *output)
     fprintf(output, "%s %s\t%s\n", type_strings[s->type], size_buf, s->name);
 }
 
-void *copy_data(void *args)
+static uint32_t crc32c_table[8][256];
+
+static void crc32c_init_table(void)
 {
-    Settings *s = (Settings*)args;
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = (uint32_t)i;
+        for (int j = 0; j < 8; j++)
+            c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+        crc32c_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t-1][i] >> 8) ^ crc32c_table[0][crc32c_table[t-1][i] & 0xff];
+    }
+}
 
-    const int max_chunk = 16 * 1024 * 1024;
-    int chunk_size = s->chunksize > 0 ? s->chunksize : 4096;
-    if (chunk_size > max_chunk)
-        chunk_size = max_chunk;
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
 
-    char *buf = malloc(max_chunk);
+#if defined(__x86_64__)
+// SSE4.2 has an instruction for exactly this polynomial, which is picked at runtime so that the default build still uses it
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
 
-    struct timespec t1 = {0}, t2 = {0};
-    if (!s->noautochunk)
-        clock_gettime(CLOCK_MONOTONIC, &t1);
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t len) = crc32c_soft;
 
-    double current_speed = 0.0;
+#define XXH_P1  0x9e3779b185ebca87ULL
+#define XXH_P2  0xc2b2ae3d27d4eb4fULL
+#define XXH_P3  0x165667b19e3779f9ULL
+#define XXH_P4  0x85ebca77c2b2ae63ULL
+#define XXH_P5  0x27d4eb2f165667c5ULL
 
-    int64_t total_size = s->totalsize;
-    if (total_size <= 0)
-        total_size = s->streams[0].size;
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t mem[32];
+    int used;
+} Xxh64;
 
-    int64_t offset = 0;
-    while (total_size <= 0 || offset < total_size) {
-        int64_t to_read = total_size > 0 ? (total_size - offset) : chunk_size;
-        to_read = to_read < chunk_size ? to_read : chunk_size;
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
 
-        int rsz = read(s->streams[0].fd, buf, (int)to_read);
-        if (rsz <= 0)
-            break;
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    return rotl64(acc + input * XXH_P2, 31) * XXH_P1;
+}
 
-        int n_closed_outputs = 0;
-        for (int i = 1; i < s->n_streams; i++) {
-            if (s->streams[i].fd == -1) {
-                n_closed_outputs++;
-                continue;
-            }
-            int w = 0;
-            while (w < rsz) {
-                int res = write(s->streams[i].fd, &buf[w], rsz - w);
-                if (res <= 0)
-                    break;
-                w += res;
-            }
-            if (w == 0) {
-                if (!s->nosync)
-                    fsync(s->streams[i].fd);
-                if (s->streams[i].fd > 2)
-                    close(s->streams[i].fd);
-                s->streams[i].fd = -1;
-            }
-            bytes_written += w;
-        }
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    return (acc ^ xxh64_round(0, val)) * XXH_P1 + XXH_P4;
+}
 
-        if (n_closed_outputs >= s->n_streams - 1)
-            break;
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
 
-        if (!s->nosync) {
-            for (int i = 1; i < s->n_streams; i++) {
-                if (s->streams[i].fd != -1)
-                    fdatasync(s->streams[i].fd);
-            }
-        }
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
 
-        if (!s->noautochunk && chunk_size < max_chunk) {
-            clock_gettime(CLOCK_MONOTONIC, &t2);
-            int64_t delta = t2.tv_nsec - t1.tv_nsec + 1000000L * (t2.tv_sec - t1.tv_sec);
-            double speed = (double)rsz / (double)delta;
-            if (speed > current_speed) {
-                int new_cs = chunk_size << 1;
-                chunk_size = new_cs <= max_chunk ? new_cs : max_chunk;
-                current_speed = speed;
-            }
-            t1 = t2;
-        }
+static void xxh64_init(Xxh64 *x)
+{
+    memset(x, 0, sizeof(Xxh64));
+    x->v[0] = XXH_P1 + XXH_P2;
+    x->v[1] = XXH_P2;
+    x->v[2] = 0;
+    x->v[3] = -XXH_P1;
+}
+
+static void xxh64_update(Xxh64 *x, const uint8_t *p, size_t len)
+{
+    x->total += len;
+    if (x->used + len < 32) {
+        memcpy(&x->mem[x->used], p, len);
+        x->used += (int)len;
+        return;
     }
 
-    for (int i = 0; i < s->n_streams; i++) {
-        if (!s->nosync && i > 0 && s->streams[i].fd != -1)
-            fsync(s->streams[i].fd);
-        if (s->streams[i].fd > 2)
-            close(s->streams[i].fd);
+    if (x->used > 0) {
+        int fill = 32 - x->used;
+        memcpy(&x->mem[x->used], p, fill);
+        for (int i = 0; i < 4; i++)
+            x->v[i] = xxh64_round(x->v[i], read64(&x->mem[i * 8]));
+        p += fill;
+        len -= fill;
+        x->used = 0;
     }
 
-    cancelled = 1;
-    if (s->finished_fd > 0) {
-        char c = 1;
-        write(s->finished_fd, &c, 1);
+    while (len >= 32) {
+        for (int i = 0; i < 4; i++)
+            x->v[i] = xxh64_round(x->v[i], read64(&p[i * 8]));
+        p += 32;
+        len -= 32;
     }
 
-    return NULL;
+    memcpy(x->mem, p, len);
+    x->used = (int)len;
+}
+
+static uint64_t xxh64_final(Xxh64 *x)
+{
+    uint64_t h;
+    if (x->total >= 32) {
+        h = rotl64(x->v[0], 1) + rotl64(x->v[1], 7) + rotl64(x->v[2], 12) + rotl64(x->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge(h, x->v[i]);
+    }
+    else {
+        h = x->v[2] + XXH_P5;
+    }
+    h += x->total;
+
+    const uint8_t *p = x->mem;
+    int len = x->used;
+    for (; len >= 8; p += 8, len -= 8)
+        h = rotl64(h ^ xxh64_round(0, read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (len >= 4) {
+        h = rotl64(h ^ ((uint64_t)read32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--)
+        h = rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t mem[64];
+    int used;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(uint32_t *h, const uint8_t *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i-15], 7) ^ rotr32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr32(w[i-2], 17) ^ rotr32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_init(Sha256 *sh)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memset(sh, 0, sizeof(Sha256));
+    memcpy(sh->h, iv, sizeof(iv));
+}
+
+static void sha256_update(Sha256 *sh, const uint8_t *p, size_t len)
+{
+    sh->total += len;
+    if (sh->used > 0) {
+        size_t room = 64 - sh->used, fill = room < len ? room : len;
+        memcpy(&sh->mem[sh->used], p, fill);
+        sh->used += (int)fill;
+        p += fill;
+        len -= fill;
+        if (sh->used < 64)
+            return;
+        sha256_block(sh->h, sh->mem);
+        sh->used = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(sh->h, p);
+    memcpy(sh->mem, p, len);
+    sh->used = (int)len;
+}
+
+static void sha256_final(Sha256 *sh, uint8_t *out)
+{
+    uint64_t bits = sh->total * 8;
+    uint8_t pad[72] = {0x80};
+    int pad_len = (sh->used < 56 ? 56 : 120) - sh->used;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - i * 8));
+    sha256_update(sh, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; i++) {
+        out[i*4]   = (uint8_t)(sh->h[i] >> 24);
+        out[i*4+1] = (uint8_t)(sh->h[i] >> 16);
+        out[i*4+2] = (uint8_t)(sh->h[i] >> 8);
+        out[i*4+3] = (uint8_t)sh->h[i];
+    }
+}
+
+typedef struct {
+    int algo;
+    uint32_t crc;
+    Xxh64 xxh;
+    Sha256 sha;
+} HashCtx;
+
+void hash_init(HashCtx *h, int algo)
+{
+    h->algo = algo;
+    h->crc = 0xffffffff;
+    if (algo == HASH_XXH64)
+        xxh64_init(&h->xxh);
+    else if (algo == HASH_SHA256)
+        sha256_init(&h->sha);
+}
+
+void hash_update(HashCtx *h, const void *data, size_t len)
+{
+    if (h->algo == HASH_CRC32C)
+        h->crc = crc32c_update(h->crc, data, len);
+    else if (h->algo == HASH_XXH64)
+        xxh64_update(&h->xxh, data, len);
+    else if (h->algo == HASH_SHA256)
+        sha256_update(&h->sha, data, len);
+}
+
+// Writes the digest in big-endian order, so that it prints the same way as other tools do. Returns its length in bytes
+int hash_final(HashCtx *h, uint8_t *out)
+{
+    if (h->algo == HASH_CRC32C || h->algo == HASH_XXH64) {
+        uint64_t v = h->algo == HASH_CRC32C ? (uint64_t)~h->crc : xxh64_final(&h->xxh);
+        int len = h->algo == HASH_CRC32C ? 4 : 8;
+        for (int i = 0; i < len; i++)
+            out[i] = (uint8_t)(v >> ((len - 1 - i) * 8));
+        return len;
+    }
+    if (h->algo == HASH_SHA256) {
+        sha256_final(&h->sha, out);
+        return 32;
+    }
+    return 0;
+}
+
+void hash_setup(void)
+{
+    crc32c_init_table();
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_sse42;
+#endif
+}
+
+// Compressed streams are a header followed by independent frames, each of which can be decompressed on its own.
+// Every frame starts with its compressed length, raw length, codec and the CRC32C of the raw data.
+// The last frame is an index of where every frame starts in the stream and in the raw data,
+// and the stream ends with a trailer pointing at the index, so that a seekable stream can be decompressed in any order
+#define FRAME_MAGIC    "CHNKRZ01"
+#define INDEX_MAGIC    "CHNKIDX1"
+#define FRAME_HEADER   16
+#define INDEX_ENTRY    16
+#define TRAILER_SIZE   16
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline void put_le64(uint8_t *p, uint64_t v)
+{
+    put_le32(p, (uint32_t)v);
+    put_le32(&p[4], (uint32_t)(v >> 32));
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(&p[4]) << 32;
+}
+
+static uint32_t frame_crc(const void *data, int len)
+{
+    return ~crc32c_update(~0U, data, len);
+}
+
+#define LZ4_HASH_BITS  16
+#define LZ4_MIN_MATCH  4
+#define LZ4_LAST_LITERALS  5
+#define LZ4_MATCH_LIMIT    12
+
+static int lz4_bound(int n)
+{
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, int n)
+{
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// Greedy LZ4 block compression with a single hash table, in the format the reference lz4 decoder accepts.
+// Positions that keep failing to match are stepped over faster, so incompressible data costs little.
+// Returns the compressed size, or 0 if it wouldn't fit in cap
+static int lz4_compress(const uint8_t *src, int n, uint8_t *dst, int cap, uint32_t *table)
+{
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    if (n > LZ4_MATCH_LIMIT) {
+        memset(table, 0, sizeof(uint32_t) << LZ4_HASH_BITS);
+        const uint8_t *limit = end - LZ4_MATCH_LIMIT;
+        const uint8_t *match_end = end - LZ4_LAST_LITERALS;
+        ip++;
+
+        while (ip < limit) {
+            uint32_t seq = load32(ip);
+            uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > 65535 || load32(ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *mp = ip + LZ4_MIN_MATCH, *mr = ref + LZ4_MIN_MATCH;
+            while (mp + 8 <= match_end) {
+                uint64_t diff = load64(mp) ^ load64(mr);
+                if (diff) {
+                    mp += __builtin_ctzll(diff) >> 3;
+                    goto matched;
+                }
+                mp += 8;
+                mr += 8;
+            }
+            while (mp < match_end && *mp == *mr) {
+                mp++;
+                mr++;
+            }
+        matched:;
+            int lit = (int)(ip - anchor);
+            int mlen = (int)(mp - ip) - LZ4_MIN_MATCH;
+            if (oend - op < 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1)
+                return 0;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15)
+                op = lz4_put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            int off = (int)(ip - ref);
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15)
+                op = lz4_put_length(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    int lit = (int)(end - anchor);
+    if (oend - op < 1 + lit + lit / 255 + 1)
+        return 0;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+        op = lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (int)(op - dst);
+}
+
+// Returns the decompressed size, or -1 if the block is corrupt or doesn't fit in cap
+static int lz4_decompress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > iend - ip || lit > oend - op)
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > op - dst)
+            return -1;
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > oend - op)
+            return -1;
+
+        const uint8_t *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+        }
+        else {
+            for (int i = 0; i < mlen; i++)
+                op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return (int)(op - dst);
+}
+
+// The largest a frame holding len bytes of raw data can get, header included
+static int frame_bound(int len)
+{
+#ifdef HAVE_ZSTD
+    int zb = (int)ZSTD_compressBound(len);
+    if (zb > lz4_bound(len))
+        return FRAME_HEADER + zb;
+#endif
+    return FRAME_HEADER + lz4_bound(len);
+}
+
+// Fills in a frame for len bytes of raw data, falling back to storing it as is when it doesn't compress.
+// frame needs room for frame_bound(len) bytes. Returns the size of the whole frame
+static int encode_frame(int codec, const char *raw, int len, uint8_t *frame, uint32_t *table)
+{
+    uint8_t *payload = &frame[FRAME_HEADER];
+    int cap = frame_bound(len) - FRAME_HEADER;
+    int n = 0;
+    if (codec == CODEC_LZ4)
+        n = lz4_compress((const uint8_t*)raw, len, payload, cap, table);
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        size_t res = ZSTD_compress(payload, cap, raw, len, 1);
+        n = ZSTD_isError(res) ? 0 : (int)res;
+    }
+#endif
+    if (n <= 0 || n >= len) {
+        codec = CODEC_STORED;
+        n = len;
+        memcpy(payload, raw, len);
+    }
+
+    put_le32(frame, (uint32_t)n);
+    put_le32(&frame[4], (uint32_t)len);
+    put_le32(&frame[8], (uint32_t)codec);
+    put_le32(&frame[12], frame_crc(raw, len));
+    return FRAME_HEADER + n;
+}
+
+// Decodes a whole frame (header included) into raw, which has room for cap bytes. Returns the raw size, or -1 if the frame is bad
+static int decode_frame(const uint8_t *frame, int len, char *raw, int cap)
+{
+    if (len < FRAME_HEADER)
+        return -1;
+    int n = (int)get_le32(frame);
+    int raw_len = (int)get_le32(&frame[4]);
+    int codec = (int)get_le32(&frame[8]);
+    const uint8_t *payload = &frame[FRAME_HEADER];
+    if (n != len - FRAME_HEADER || raw_len > cap)
+        return -1;
+
+    int res = -1;
+    if (codec == CODEC_STORED && n == raw_len) {
+        memcpy(raw, payload, n);
+        res = n;
+    }
+    else if (codec == CODEC_LZ4) {
+        res = lz4_decompress(payload, n, (uint8_t*)raw, raw_len);
+    }
+#ifdef HAVE_ZSTD
+    else if (codec == CODEC_ZSTD) {
+        size_t z = ZSTD_decompress(raw, raw_len, payload, n);
+        res = ZSTD_isError(z) ? -1 : (int)z;
+    }
+#endif
+    if (res != raw_len || frame_crc(raw, raw_len) != get_le32(&frame[12]))
+        return -1;
+    return res;
+}
+
+// Channels passed in with -ifd/-ofd aren't stat'd up front, so find out what they really are
+static int real_type(Stream *st)
+{
+    if (st->type != TYPE_FD)
+        return st->type;
+
+    struct stat sb;
+    if (fstat(st->fd, &sb) < 0)
+        return TYPE_UNKNOWN;
+
+    switch (sb.st_mode & S_IFMT) {
+        case S_IFREG:  return TYPE_REG;
+        case S_IFBLK:  return TYPE_BLOCK;
+        case S_IFCHR:  return TYPE_CHR;
+        case S_IFIFO:  return TYPE_FIFO;
+        case S_IFSOCK: return TYPE_SOCKET;
+    }
+    return TYPE_UNKNOWN;
+}
+
+static int64_t round_up(int64_t n, int64_t align)
+{
+    return align > 1 ? (n + align - 1) / align * align : n;
+}
+
+// Chunk sizes are kept to a multiple of the physical sector size when using O_DIRECT
+int fit_chunk_size(Settings *s, int64_t size)
+{
+    if (s->sector > 1) {
+        size = round_up(size, s->sector);
+        if (size > MAX_CHUNK)
+            size = MAX_CHUNK / s->sector * s->sector;
+    }
+    else if (size > MAX_CHUNK) {
+        size = MAX_CHUNK;
+    }
+    return (int)size;
+}
+
+char *alloc_chunk(Settings *s, int size)
+{
+    if (s->align <= 1)
+        return malloc(size);
+
+    void *buf = NULL;
+    if (posix_memalign(&buf, s->align > 4096 ? s->align : 4096, round_up(size, s->align)) != 0)
+        return NULL;
+    return buf;
+}
+
+// With -concat, the inputs after the first are kept after the outputs in the stream array
+static Stream *input_stream(Settings *s, int k)
+{
+    return k == 0 ? &s->streams[0] : &s->streams[s->n_streams + k - 1];
+}
+
+// How much is to be copied: -totalsize if given, otherwise the size of the input, or of all the inputs together with -concat.
+// 0 or less means the input is read until it runs out
+static int64_t copy_size(Settings *s)
+{
+    if (s->totalsize > 0)
+        return s->totalsize;
+
+    int64_t size = 0;
+    for (int k = 0; k < s->n_inputs; k++) {
+        Stream *in = input_stream(s, k);
+        if (in->size < 0)
+            return -1;
+        size += in->size;
+    }
+    return size;
+}
+
+// Finds the input which holds offset off of the whole copy, and turns off into an offset within that input
+static Stream *input_at(Settings *s, int64_t *off)
+{
+    int k = 0;
+    while (k < s->n_inputs - 1 && *off >= input_stream(s, k)->size) {
+        *off -= input_stream(s, k)->size;
+        k++;
+    }
+    return input_stream(s, k);
+}
+
+// Telemetry for -stats and -statsstream. Every read, write and sync on a stream is timed into a histogram
+// with 16 linear buckets per power of two (so within about 6% of the real value), which is cheap enough to update from any thread
+#define OP_READ   0
+#define OP_WRITE  1
+#define OP_SYNC   2
+
+static const char * const op_strings[] = {"read", "write", "sync"};
+#define N_OPS (int)(sizeof(op_strings) / sizeof(op_strings[0]))
+
+#define HIST_SUB_BITS  4
+#define HIST_BUCKETS   (64 << HIST_SUB_BITS)
+
+typedef struct {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} Histogram;
+
+struct StreamStats {
+    Histogram ops[N_OPS];
+    _Atomic int64_t bytes;
+    _Atomic int64_t blocked_ns;
+    int64_t last_bytes;
+    double rate;
+    double avg_rate;
+    double peak_rate;
+};
+
+#define MAX_CHUNK_SIZES  4096
+
+static int64_t telemetry_epoch = 0;
+static pthread_mutex_t chunk_sizes_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t chunk_size_times[MAX_CHUNK_SIZES];
+static int chunk_sizes[MAX_CHUNK_SIZES];
+static int n_chunk_sizes = 0;
+
+int64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_nsec + 1000000000LL * t.tv_sec;
+}
+
+// Turns on timing of every operation from here on. Each stream's figures go in its own StreamStats
+void telemetry_start(Settings *s)
+{
+    for (int i = 0; i < s->n_streams + s->n_inputs - 1; i++)
+        s->streams[i].stats = calloc(1, sizeof(StreamStats));
+    telemetry_epoch = now_ns();
+    telemetry = true;
+}
+
+static int hist_bucket(uint64_t v)
+{
+    if (v < (1 << HIST_SUB_BITS))
+        return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + (int)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// The smallest value that lands in a bucket
+static uint64_t hist_value(int bucket)
+{
+    int group = bucket >> HIST_SUB_BITS;
+    uint64_t sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+    return group == 0 ? sub : ((1 << HIST_SUB_BITS) + sub) << (group - 1);
+}
+
+static void hist_record(Histogram *h, int64_t ns)
+{
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    h->sum_ns += v;
+    uint64_t max = h->max_ns;
+    while (v > max && !atomic_compare_exchange_weak(&h->max_ns, &max, v));
+}
+
+static uint64_t hist_percentile(Histogram *h, double p)
+{
+    uint64_t total = h->total;
+    if (total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p * (double)(total - 1)), seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return h->max_ns;
+}
+
+static inline int64_t timer_start(void)
+{
+    return telemetry ? now_ns() : 0;
+}
+
+// Records how long an operation on st took, and how many bytes it moved
+static void timer_stop(Stream *st, int op, int64_t start, int64_t bytes)
+{
+    if (!telemetry || !st->stats)
+        return;
+    hist_record(&st->stats->ops[op], now_ns() - start);
+    if (bytes > 0)
+        st->stats->bytes += bytes;
+}
+
+// For transfers that read and write in one go, which are timed as writes, so the input still gets credited with the bytes
+static void count_bytes(Stream *st, int64_t bytes)
+{
+    if (telemetry && st->stats)
+        st->stats->bytes += bytes;
+}
+
+// Records time that st spent waiting on the other side of the copy, since start
+static void blocked_stop(Stream *st, int64_t start)
+{
+    if (telemetry && st->stats)
+        st->stats->blocked_ns += now_ns() - start;
+}
+
+// Remembers each chunk size an engine settles on, for -stats to show what the tuner did over time
+static void record_chunk_size(int size)
+{
+    if (!telemetry)
+        return;
+    pthread_mutex_lock(&chunk_sizes_lock);
+    if (n_chunk_sizes < MAX_CHUNK_SIZES && (n_chunk_sizes == 0 || chunk_sizes[n_chunk_sizes - 1] != size)) {
+        chunk_size_times[n_chunk_sizes] = now_ns() - telemetry_epoch;
+        chunk_sizes[n_chunk_sizes++] = size;
+    }
+    pthread_mutex_unlock(&chunk_sizes_lock);
+}
+
+static void json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (const unsigned char *c = (const unsigned char*)str; c && *c; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(f, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(f, "\\u%04x", *c);
+        else
+            fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+// Every input, then every output
+static int n_stat_streams(Settings *s)
+{
+    return s->n_streams + s->n_inputs - 1;
+}
+
+static Stream *stat_stream(Settings *s, int i, int64_t *bytes)
+{
+    if (i < s->n_inputs) {
+        Stream *st = input_stream(s, i);
+        *bytes = st->stats->bytes;
+        return st;
+    }
+    Stream *st = &s->streams[i - s->n_inputs + 1];
+    *bytes = st->written;
+    return st;
+}
+
+// Called once per progress tick. Throughput is given both for the last tick and as a moving average over about 10 seconds.
+// With f set, the figures are also written out as one line of JSON
+void stats_tick(Settings *s, FILE *f)
+{
+    static int64_t last_tick = 0;
+    int64_t now = now_ns();
+    double secs = (double)(now - telemetry_epoch) / 1e9;
+    double dt = last_tick ? (double)(now - last_tick) / 1e9 : secs;
+    last_tick = now;
+    double alpha = dt / (dt + 10.0);
+
+    if (f) {
+        fprintf(f, "{\"t\":%.3f,\"bytes_read\":%ld,\"bytes_written\":%ld,\"chunk_size\":%d,\"streams\":[",
+            secs, bytes_read, bytes_written, n_chunk_sizes > 0 ? chunk_sizes[n_chunk_sizes - 1] : 0);
+    }
+
+    for (int i = 0; i < n_stat_streams(s); i++) {
+        int64_t bytes;
+        Stream *st = stat_stream(s, i, &bytes);
+        StreamStats *ss = st->stats;
+        ss->rate = dt > 0.0 ? (double)(bytes - ss->last_bytes) / dt : 0.0;
+        ss->avg_rate = ss->last_bytes == 0 && ss->avg_rate == 0.0 ? ss->rate : ss->avg_rate + alpha * (ss->rate - ss->avg_rate);
+        ss->peak_rate = ss->rate > ss->peak_rate ? ss->rate : ss->peak_rate;
+        ss->last_bytes = bytes;
+
+        if (f) {
+            fprintf(f, "%s{\"name\":", i > 0 ? "," : "");
+            json_string(f, st->name);
+            fprintf(f, ",\"role\":\"%s\",\"bytes\":%ld,\"rate\":%.0f,\"avg_rate\":%.0f,\"blocked_seconds\":%.3f",
+                i < s->n_inputs ? "input" : "output", bytes, ss->rate, ss->avg_rate, (double)ss->blocked_ns / 1e9);
+            for (int op = 0; op < N_OPS; op++) {
+                if (ss->ops[op].total > 0)
+                    fprintf(f, ",\"%s_p99_us\":%.1f", op_strings[op], (double)hist_percentile(&ss->ops[op], 0.99) / 1e3);
+            }
+            fprintf(f, "}");
+        }
+    }
+
+    if (f) {
+        fprintf(f, "]}\n");
+        fflush(f);
+    }
+}
+
+static void write_histogram(FILE *f, Histogram *h)
+{
+    uint64_t total = h->total;
+    fprintf(f, "{\"count\":%lu,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f,\"buckets\":[",
+        total, total ? (double)h->sum_ns / (double)total / 1e3 : 0.0,
+        (double)hist_percentile(h, 0.5) / 1e3, (double)hist_percentile(h, 0.9) / 1e3,
+        (double)hist_percentile(h, 0.99) / 1e3, (double)hist_percentile(h, 0.999) / 1e3, (double)h->max_ns / 1e3);
+
+    // Only the buckets that were hit, each as the lowest latency it holds and how many operations it counted
+    bool first = true;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (h->counts[i] == 0)
+            continue;
+        fprintf(f, "%s[%.3f,%lu]", first ? "" : ",", (double)hist_value(i) / 1e3, (uint64_t)h->counts[i]);
+        first = false;
+    }
+    fprintf(f, "]}");
+}
+
+void write_stats_summary(Settings *s, FILE *f)
+{
+    double secs = (double)(now_ns() - telemetry_epoch) / 1e9;
+    fprintf(f, "{\n  \"elapsed_seconds\": %.3f,\n  \"engine\": \"%s\",\n", secs, copy_method);
+    fprintf(f, "  \"bytes_read\": %ld,\n  \"bytes_written\": %ld,\n", bytes_read, bytes_written);
+    fprintf(f, "  \"read_bytes_per_second\": %.0f,\n  \"write_bytes_per_second\": %.0f,\n",
+        secs > 0.0 ? (double)bytes_read / secs : 0.0, secs > 0.0 ? (double)bytes_written / secs : 0.0);
+
+    fprintf(f, "  \"streams\": [");
+    for (int i = 0; i < n_stat_streams(s); i++) {
+        int64_t bytes;
+        Stream *st = stat_stream(s, i, &bytes);
+        StreamStats *ss = st->stats;
+
+        int64_t busy_ns = 0;
+        for (int op = 0; op < N_OPS; op++)
+            busy_ns += ss->ops[op].sum_ns;
+
+        fprintf(f, "%s\n    {\n      \"name\": ", i > 0 ? "," : "");
+        json_string(f, st->name);
+        fprintf(f, ",\n      \"role\": \"%s\",\n      \"bytes\": %ld,\n", i < s->n_inputs ? "input" : "output", bytes);
+        fprintf(f, "      \"bytes_per_second\": %.0f,\n      \"peak_bytes_per_second\": %.0f,\n",
+            secs > 0.0 ? (double)bytes / secs : 0.0, ss->peak_rate);
+        fprintf(f, "      \"busy_seconds\": %.3f,\n      \"blocked_seconds\": %.3f",
+            (double)busy_ns / 1e9, (double)ss->blocked_ns / 1e9);
+        for (int op = 0; op < N_OPS; op++) {
+            fprintf(f, ",\n      \"%s\": ", op_strings[op]);
+            write_histogram(f, &ss->ops[op]);
+        }
+        fprintf(f, "\n    }");
+    }
+
+    fprintf(f, "\n  ],\n  \"chunk_sizes\": [");
+    for (int i = 0; i < n_chunk_sizes; i++)
+        fprintf(f, "%s[%.3f,%d]", i > 0 ? "," : "", (double)chunk_size_times[i] / 1e9, chunk_sizes[i]);
+    fprintf(f, "]\n}\n");
+}
+
+// O_DIRECT reads have to be a whole number of sectors long. Reading past the end of the input just comes back short.
+// When only the outputs use O_DIRECT, short reads from pipes are topped up so that every write but the last stays aligned
+int read_stream(Settings *s, Stream *st, char *buf, int len)
+{
+    int64_t t = timer_start();
+    int got;
+    if (!st->direct) {
+        got = read(st->fd, buf, len);
+        while (s->align > 1 && got > 0 && got < len) {
+            int res = read(st->fd, &buf[got], len - got);
+            if (res <= 0)
+                break;
+            got += res;
+        }
+    }
+    else {
+        got = read(st->fd, buf, (int)round_up(len, s->align));
+        got = got > len ? len : got;
+    }
+    timer_stop(st, OP_READ, t, got);
+    return got;
+}
+
+// Writes as much of buf as possible, returning how much was written.
+// The final part of a copy is usually not a whole number of sectors, which O_DIRECT won't accept,
+// so that part is written through the page cache instead
+int write_stream(Stream *st, char *buf, int len)
+{
+    int64_t t = timer_start();
+    int w = 0;
+    while (w < len) {
+        int res = write(st->fd, &buf[w], len - w);
+        if (res < 0 && errno == EINVAL && st->direct) {
+            fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_DIRECT);
+            st->direct = false;
+            continue;
+        }
+        if (res <= 0)
+            break;
+        w += res;
+    }
+    timer_stop(st, OP_WRITE, t, w);
+    return w;
+}
+
+bool is_zero(const char *buf, int len)
+{
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 128 <= len; i += 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)&buf[i]), _mm256_loadu_si256((const __m256i*)&buf[i+32])),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)&buf[i+64]), _mm256_loadu_si256((const __m256i*)&buf[i+96]))
+        );
+        if (!_mm256_testz_si256(v, v))
+            return false;
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= len; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)&buf[i]), _mm_loadu_si128((const __m128i*)&buf[i+16])),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)&buf[i+32]), _mm_loadu_si128((const __m128i*)&buf[i+48]))
+        );
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            return false;
+    }
+#endif
+    for (; i < len; i++) {
+        if (buf[i])
+            return false;
+    }
+    return true;
+}
+
+// Reads the next part of the input into buf, returning its length.
+// With -sparse, holes in a file are found with SEEK_DATA/SEEK_HOLE and skipped over rather than read,
+// and *zero is set for holes and chunks that read back as all zeros.
+// data_end caches where the current run of data ends, so that most chunks don't need to ask
+int next_chunk(Settings *s, char *buf, int len, bool *zero, int64_t *data_end)
+{
+    Stream *in = input_stream(s, s->cur_input);
+    *zero = false;
+
+    if (s->sparse && in->type == TYPE_REG) {
+        off_t pos = lseek(in->fd, 0, SEEK_CUR);
+        if (pos >= 0 && pos >= *data_end) {
+            off_t data = lseek(in->fd, pos, SEEK_DATA);
+            if (data < 0 && errno == ENXIO)
+                data = in->size > pos ? in->size : pos;
+
+            if (data < 0) {
+                *data_end = INT64_MAX;
+            }
+            else {
+                off_t hole = lseek(in->fd, data, SEEK_HOLE);
+                *data_end = hole > data ? hole : INT64_MAX;
+            }
+            lseek(in->fd, pos, SEEK_SET);
+
+            if (data > pos) {
+                int n = data - pos < len ? (int)(data - pos) : len;
+                lseek(in->fd, n, SEEK_CUR);
+                *zero = true;
+                return n;
+            }
+        }
+        if (pos >= 0 && *data_end - pos < len)
+            len = (int)(*data_end - pos);
+    }
+
+    int rsz = read_stream(s, in, buf, len);
+
+    // With -concat, the end of one input just means moving on to the next
+    if (rsz == 0 && s->cur_input < s->n_inputs - 1) {
+        s->cur_input++;
+        *data_end = 0;
+        return next_chunk(s, buf, len, zero, data_end);
+    }
+
+    if (s->sparse && rsz > 0)
+        *zero = is_zero(buf, rsz);
+    return rsz;
+}
+
+// Striping needs every chunk but the last to be full, so that each chunk always lands in the same place in the same output.
+// Skipped holes are filled in with zeros, and the chunk as a whole is then checked for being all zeros
+static int fill_chunk(Settings *s, char *buf, int len, bool *zero, int64_t *data_end)
+{
+    int got = 0;
+    while (got < len) {
+        // Only the end of an input can leave the buffer misaligned, after which the next input can't use O_DIRECT
+        Stream *in = input_stream(s, s->cur_input);
+        if (in->direct && got % s->align != 0) {
+            fcntl(in->fd, F_SETFL, fcntl(in->fd, F_GETFL) & ~O_DIRECT);
+            in->direct = false;
+        }
+
+        bool skipped = false;
+        int n = next_chunk(s, &buf[got], len - got, &skipped, data_end);
+        if (n <= 0)
+            break;
+        if (skipped)
+            memset(&buf[got], 0, n);
+        got += n;
+    }
+    *zero = s->sparse && got > 0 && is_zero(buf, got);
+    return got;
+}
+
+// Leaves a hole in an output file instead of writing zeros. Parts of the file that already exist are punched out.
+// pos is where the chunk goes, or -1 for the output's current position, which is then moved past the chunk
+static bool skip_output(Stream *st, int len, int64_t pos)
+{
+    bool seek = pos < 0;
+    if (seek)
+        pos = lseek(st->fd, 0, SEEK_CUR);
+    if (pos < 0)
+        return false;
+
+    if (pos < st->size) {
+        int64_t n = st->size - pos < len ? st->size - pos : len;
+        if (fallocate(st->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, n) < 0)
+            return false;
+    }
+    if (pos + len > st->size) {
+        if (ftruncate(st->fd, pos + len) < 0)
+            return false;
+        st->size = pos + len;
+    }
+    return !seek || lseek(st->fd, pos + len, SEEK_SET) >= 0;
+}
+
+static bool pwrite_all(Stream *st, char *buf, int len, int64_t off)
+{
+    int64_t t = timer_start();
+    int w = 0;
+    while (w < len) {
+        ssize_t res = pwrite(st->fd, &buf[w], len - w, off + w);
+        if (res < 0 && errno == EINVAL && st->direct) {
+            fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_DIRECT);
+            st->direct = false;
+            continue;
+        }
+        if (res <= 0)
+            break;
+        w += (int)res;
+    }
+    timer_stop(st, OP_WRITE, t, w);
+    return w == len;
+}
+
+// Reads what the output already holds where this chunk is going, and only writes the blocks that differ.
+// Returns -1 if the output couldn't be read back, in which case the chunk should just be written
+static int write_differences(Settings *s, Stream *st, char *buf, int len, int64_t pos)
+{
+    bool seek = pos < 0;
+    if (seek)
+        pos = lseek(st->fd, 0, SEEK_CUR);
+    if (pos < 0)
+        return -1;
+
+    if (st->scratch_len < len) {
+        free(st->scratch);
+        st->scratch = alloc_chunk(s, len);
+        st->scratch_len = st->scratch ? len : 0;
+        if (!st->scratch)
+            return -1;
+    }
+
+    int have = 0;
+    while (have < len) {
+        ssize_t res = pread(st->fd, &st->scratch[have], len - have, pos + have);
+        if (res <= 0)
+            break;
+        have += (int)res;
+    }
+    if (have == 0 && pos < st->size)
+        return -1;
+
+    // Compare a block at a time, so that a single changed byte only rewrites its own block. Runs of changed blocks are written together
+    int block = st->pbs > 0 ? st->pbs : 4096;
+    int run_start = -1;
+    for (int i = 0; i <= len; i += block) {
+        int n = len - i < block ? len - i : block;
+        bool differs = n > 0 && (i + n > have || memcmp(&buf[i], &st->scratch[i], n) != 0);
+
+        if (differs && run_start < 0) {
+            run_start = i;
+        }
+        else if (!differs && run_start >= 0) {
+            if (!pwrite_all(st, &buf[run_start], i - run_start, pos + run_start))
+                return 0;
+            run_start = -1;
+        }
+
+        if (n > 0 && !differs)
+            bytes_unchanged += n;
+    }
+    if (run_start >= 0 && !pwrite_all(st, &buf[run_start], len - run_start, pos + run_start))
+        return 0;
+
+    if (seek)
+        lseek(st->fd, pos + len, SEEK_SET);
+    return len;
+}
+
+// Writes a chunk to an output, returning how much was written. Chunks of zeros become holes in files when using -sparse.
+// off is where in the output the chunk goes, or -1 to write at the output's current position
+int put_chunk(Settings *s, Stream *st, char *buf, int len, bool zero, int64_t off)
+{
+    if (zero && st->type == TYPE_REG && skip_output(st, len, off)) {
+        bytes_skipped += len;
+        return len;
+    }
+
+    buf = zero ? s->zeros : buf;
+    if (s->diffwrite && (st->type == TYPE_REG || st->type == TYPE_BLOCK)) {
+        int res = write_differences(s, st, buf, len, off);
+        if (res >= 0)
+            return res;
+    }
+    if (off >= 0)
+        return pwrite_all(st, buf, len, off) ? len : 0;
+    return write_stream(st, buf, len);
+}
+
+// Called after each chunk written to an output. By default that means a fdatasync, but with -syncwindow,
+// writeback of the chunk is only started, and the chunk from -syncwindow chunks ago is waited on instead.
+// That keeps the amount of dirty data bounded without stalling the device on every chunk.
+// off is where the chunk was written, or -1 if it ends at the output's current position
+void sync_chunk(Settings *s, Stream *st, int64_t off, int len)
+{
+    if (s->nosync || st->fd == -1)
+        return;
+
+    if (s->syncwindow <= 0 || (st->type != TYPE_REG && st->type != TYPE_BLOCK)) {
+        int64_t t = timer_start();
+        fdatasync(st->fd);
+        timer_stop(st, OP_SYNC, t, 0);
+        return;
+    }
+
+    if (off < 0)
+        off = lseek(st->fd, 0, SEEK_CUR) - len;
+    if (off < 0)
+        return;
+
+    if (!st->wb_offs) {
+        st->wb_offs = calloc(s->syncwindow, sizeof(int64_t));
+        st->wb_lens = calloc(s->syncwindow, sizeof(int));
+    }
+
+    sync_file_range(st->fd, off, len, SYNC_FILE_RANGE_WRITE);
+
+    int idx = st->wb_count % s->syncwindow;
+    if (st->wb_count >= s->syncwindow) {
+        int64_t t = timer_start();
+        sync_file_range(st->fd, st->wb_offs[idx], st->wb_lens[idx], SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        timer_stop(st, OP_SYNC, t, 0);
+    }
+
+    st->wb_offs[idx] = off;
+    st->wb_lens[idx] = len;
+    st->wb_count++;
+}
+
+static void free_writeback(Stream *st)
+{
+    free(st->wb_offs);
+    free(st->wb_lens);
+    st->wb_offs = NULL;
+    st->wb_lens = NULL;
+    st->wb_count = 0;
+}
+
+#define TUNE_MIN_CHUNKS  8
+#define TUNE_MIN_NS      20000000LL
+
+// Finds the chunk size with the best throughput, using the time taken by whole chunks, including syncing.
+// Each candidate size (a power of two) is measured over a window of several chunks, so that one slow chunk can't
+// decide anything by itself, and revisited sizes are averaged with their earlier measurements.
+// From the starting size, it climbs up while that keeps helping by more than 5%, then tries going down,
+// then settles on the best size. If throughput at that size later drops by a quarter for a few windows in a row,
+// the device has probably changed its behaviour, and the search starts again.
+typedef struct {
+    int min_size;
+    int n_sizes;
+    int idx;
+    int best;
+    int dir;
+    int slow_windows;
+    double *score;
+    int64_t win_bytes;
+    int64_t win_ns;
+    int win_chunks;
+} ChunkTuner;
+
+static int tuner_index(ChunkTuner *t, int64_t size)
+{
+    int idx = 0;
+    while (idx < t->n_sizes - 1 && ((int64_t)t->min_size << idx) < size)
+        idx++;
+    return idx;
+}
+
+void tuner_init(ChunkTuner *t, int min_size, int max_size, int start_size)
+{
+    memset(t, 0, sizeof(ChunkTuner));
+    t->min_size = min_size;
+    t->n_sizes = 1;
+    while (((int64_t)min_size << t->n_sizes) <= max_size)
+        t->n_sizes++;
+    t->score = calloc(t->n_sizes, sizeof(double));
+    t->idx = tuner_index(t, start_size);
+    t->best = t->idx;
+    t->dir = 1;
+}
+
+int tuner_size(ChunkTuner *t)
+{
+    return t->min_size << t->idx;
+}
+
+static void tuner_explore(ChunkTuner *t, int from)
+{
+    int next = from + t->dir;
+    if (t->dir > 0 && (next >= t->n_sizes || t->score[next] > 0.0)) {
+        t->dir = -1;
+        next = t->best - 1;
+    }
+    if (next < 0 || next >= t->n_sizes || t->score[next] > 0.0) {
+        t->dir = 0;
+        next = t->best;
+    }
+    t->idx = next;
+}
+
+// Adds a chunk of len bytes which took ns nanoseconds, returning the size to use for the next chunk
+int tuner_sample(ChunkTuner *t, int len, int64_t ns)
+{
+    t->win_bytes += len;
+    t->win_ns += ns;
+    t->win_chunks++;
+    if (t->win_chunks < TUNE_MIN_CHUNKS || t->win_ns < TUNE_MIN_NS)
+        return tuner_size(t);
+
+    double rate = (double)t->win_bytes / (double)t->win_ns;
+    t->win_bytes = 0;
+    t->win_ns = 0;
+    t->win_chunks = 0;
+
+    if (t->dir == 0) {
+        if (rate < t->score[t->idx] * 0.75) {
+            if (++t->slow_windows >= 3) {
+                double keep = rate;
+                memset(t->score, 0, t->n_sizes * sizeof(double));
+                t->score[t->idx] = keep;
+                t->slow_windows = 0;
+                t->dir = 1;
+                tuner_explore(t, t->idx);
+            }
+            return tuner_size(t);
+        }
+        t->slow_windows = 0;
+        t->score[t->idx] = t->score[t->idx] * 0.75 + rate * 0.25;
+        return tuner_size(t);
+    }
+
+    double prev = t->score[t->idx];
+    t->score[t->idx] = prev > 0.0 ? (prev + rate) * 0.5 : rate;
+
+    if (t->idx != t->best) {
+        if (t->score[t->idx] > t->score[t->best] * 1.05) {
+            t->best = t->idx;
+        }
+        else if (t->dir > 0) {
+            t->dir = -1;
+            tuner_explore(t, t->best);
+            return tuner_size(t);
+        }
+        else {
+            t->dir = 0;
+            t->idx = t->best;
+            return tuner_size(t);
+        }
+    }
+    tuner_explore(t, t->idx);
+    return tuner_size(t);
+}
+
+// Chunk sizes are remembered for each combination of input and output device, so that a cache shared between
+// different disks doesn't mix them up. Files are keyed by the device holding their filesystem
+static void device_key(Stream *st, char *buf, int len)
+{
+    struct stat sb;
+    if (fstat(st->fd, &sb) < 0) {
+        snprintf(buf, len, "?");
+        return;
+    }
+    if (S_ISBLK(sb.st_mode) || S_ISCHR(sb.st_mode))
+        snprintf(buf, len, "%c%u:%u", S_ISBLK(sb.st_mode) ? 'b' : 'c', major(sb.st_rdev), minor(sb.st_rdev));
+    else if (S_ISREG(sb.st_mode))
+        snprintf(buf, len, "f%u:%u", major(sb.st_dev), minor(sb.st_dev));
+    else
+        snprintf(buf, len, "%s", type_strings[real_type(st)]);
+
+    for (int i = 0; buf[i]; i++) {
+        if (buf[i] == ' ')
+            buf[i] = 0;
+    }
+}
+
+static void chunk_cache_key(Settings *s, char *buf, int len)
+{
+    char in_key[64], out_key[64];
+    device_key(&s->streams[0], in_key, sizeof(in_key));
+    device_key(&s->streams[1], out_key, sizeof(out_key));
+    snprintf(buf, len, "%s>%s", in_key, out_key);
+}
+
+int64_t chunk_cache_load(Settings *s)
+{
+    FILE *f = fopen(s->chunkcache, "r");
+    if (!f)
+        return -1;
+
+    char key[160], line_key[160];
+    chunk_cache_key(s, key, sizeof(key));
+
+    int64_t size = -1, n;
+    while (fscanf(f, "%159s %ld", line_key, &n) == 2) {
+        if (!strcmp(key, line_key))
+            size = n;
+    }
+    fclose(f);
+    return size;
+}
+
+void chunk_cache_save(Settings *s, int64_t size)
+{
+    char key[160], line_key[160];
+    chunk_cache_key(s, key, sizeof(key));
+
+    size_t path_len = strlen(s->chunkcache) + 8;
+    char *tmp_path = malloc(path_len);
+    snprintf(tmp_path, path_len, "%s.tmp", s->chunkcache);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        free(tmp_path);
+        return;
+    }
+
+    FILE *in = fopen(s->chunkcache, "r");
+    int64_t n;
+    while (in && fscanf(in, "%159s %ld", line_key, &n) == 2) {
+        if (strcmp(key, line_key))
+            fprintf(out, "%s %ld\n", line_key, n);
+    }
+    if (in)
+        fclose(in);
+
+    fprintf(out, "%s %ld\n", key, size);
+    fclose(out);
+    rename(tmp_path, s->chunkcache);
+    free(tmp_path);
+}
+
+// Files are also keyed by inode, so that a journal can't be applied to a different file on the same filesystem
+static void journal_key(Stream *st, char *buf, int len)
+{
+    device_key(st, buf, len);
+    struct stat sb;
+    if (fstat(st->fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+        int n = (int)strlen(buf);
+        snprintf(&buf[n], len - n, ":%lu", (unsigned long)sb.st_ino);
+    }
+}
+
+// Hashes len bytes ending at off, reading through a separate descriptor so that O_DIRECT doesn't get in the way
+static bool journal_block_hash(Stream *st, int64_t off, int len, uint64_t *hash)
+{
+    int fd = open(st->name, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    char *buf = malloc(len > 0 ? len : 1);
+    int got = 0;
+    while (got < len) {
+        ssize_t res = pread(fd, &buf[got], len - got, off - len + got);
+        if (res <= 0)
+            break;
+        got += (int)res;
+    }
+    close(fd);
+
+    uint8_t digest[8];
+    HashCtx ctx;
+    hash_init(&ctx, HASH_XXH64);
+    hash_update(&ctx, buf, got);
+    hash_final(&ctx, digest);
+    free(buf);
+
+    *hash = 0;
+    for (int i = 0; i < 8; i++)
+        *hash = (*hash << 8) | digest[i];
+    return got == len;
+}
+
+// Returns the offset to carry on from, 0 if there is no journal yet, or -1 if the journal doesn't match the streams.
+// The journal lists the input and outputs it was made for, the offset synced to every output,
+// and a hash of the last chunk before that offset, which has to match in the input and in every output
+int64_t journal_load(Settings *s, FILE *output)
+{
+    FILE *f = fopen(s->journal, "r");
+    if (!f)
+        return 0;
+
+    char key[96], line_key[96];
+    int version = 0, n_streams = 0, len = 0;
+    int64_t size = -1, offset = -1;
+    uint64_t hash = 0;
+    bool valid = fscanf(f, "chunker-journal %d %d", &version, &n_streams) == 2 && version == 1 && n_streams == s->n_streams;
+
+    for (int i = 0; valid && i < s->n_streams; i++) {
+        journal_key(&s->streams[i], key, sizeof(key));
+        valid = fscanf(f, "%95s", line_key) == 1 && !strcmp(key, line_key);
+    }
+    valid = valid && fscanf(f, " size %ld offset %ld block %d %lx", &size, &offset, &len, &hash) == 4;
+    fclose(f);
+
+    if (!valid) {
+        fprintf(output, "The journal %s was made for a different copy. Delete it to start again from the beginning\n", s->journal);
+        return -1;
+    }
+    if (size != s->streams[0].size || offset < len || offset > size) {
+        fprintf(output, "The size of the input has changed since the journal %s was written\n", s->journal);
+        return -1;
+    }
+
+    for (int i = 0; i < s->n_streams; i++) {
+        uint64_t h = 0;
+        if (!journal_block_hash(&s->streams[i], offset, len, &h) || h != hash) {
+            fprintf(output, "The data before offset %ld in %s doesn't match the journal %s\n", offset, s->streams[i].name, s->journal);
+            return -1;
+        }
+    }
+    return offset;
+}
+
+// Syncs every output, then records that everything before offset has been copied. block is the last len bytes copied.
+// The journal is replaced in one go, so an interruption leaves either the old record or the new one
+static void journal_save(Settings *s, int64_t offset, const char *block, int len)
+{
+    for (int i = 1; i < s->n_streams; i++) {
+        if (s->streams[i].fd == -1)
+            return;
+        fdatasync(s->streams[i].fd);
+    }
+
+    uint8_t digest[8];
+    HashCtx ctx;
+    hash_init(&ctx, HASH_XXH64);
+    hash_update(&ctx, block, len);
+    hash_final(&ctx, digest);
+
+    size_t path_len = strlen(s->journal) + 8;
+    char *tmp_path = malloc(path_len);
+    snprintf(tmp_path, path_len, "%s.tmp", s->journal);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        free(tmp_path);
+        return;
+    }
+
+    char key[96];
+    fprintf(out, "chunker-journal 1 %d\n", s->n_streams);
+    for (int i = 0; i < s->n_streams; i++) {
+        journal_key(&s->streams[i], key, sizeof(key));
+        fprintf(out, "%s\n", key);
+    }
+    fprintf(out, "size %ld\noffset %ld\nblock %d ", s->streams[0].size, offset, len);
+    for (int i = 0; i < 8; i++)
+        fprintf(out, "%02x", digest[i]);
+    fprintf(out, "\n");
+
+    fflush(out);
+    fdatasync(fileno(out));
+    fclose(out);
+    rename(tmp_path, s->journal);
+    free(tmp_path);
+}
+
+#define JOURNAL_INTERVAL_NS  1000000000LL
+
+void copy_sync(Settings *s)
+{
+    const int max_chunk = fit_chunk_size(s, MAX_CHUNK);
+    const int min_chunk = fit_chunk_size(s, 4096);
+    int chunk_size = fit_chunk_size(s, s->chunksize > 0 ? s->chunksize : 4096);
+
+    ChunkTuner tuner = {0};
+    if (!s->noautochunk) {
+        int64_t cached = s->chunkcache && s->chunksize <= 0 ? chunk_cache_load(s) : -1;
+        tuner_init(&tuner, min_chunk, max_chunk, cached > 0 ? cached : chunk_size);
+        chunk_size = tuner_size(&tuner);
+    }
+    record_chunk_size(chunk_size);
+
+    char *buf = alloc_chunk(s, max_chunk);
+    if (s->sparse) {
+        s->zeros = alloc_chunk(s, max_chunk);
+        memset(s->zeros, 0, max_chunk);
+    }
+
+    struct timespec t1 = {0}, t2 = {0}, last_save = {0};
+    if (!s->noautochunk)
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (s->journal)
+        clock_gettime(CLOCK_MONOTONIC, &last_save);
+
+    int64_t total_size = copy_size(s);
+
+    int64_t offset = s->resume;
+    int64_t data_end = 0;
+    bool complete = true;
+    while (total_size <= 0 || offset < total_size) {
+        int64_t to_read = total_size > 0 ? (total_size - offset) : chunk_size;
+        to_read = to_read < chunk_size ? to_read : chunk_size;
+
+        // Reads and writes take turns here, so each side spends the other's time waiting
+        int64_t t_read = timer_start();
+        bool zero = false;
+        int rsz = next_chunk(s, buf, (int)to_read, &zero, &data_end);
+        if (rsz <= 0)
+            break;
+        offset += rsz;
+        for (int i = 1; i < s->n_streams; i++)
+            blocked_stop(&s->streams[i], t_read);
+        int64_t t_write = timer_start();
+
+        int n_closed_outputs = 0;
+        for (int i = 1; i < s->n_streams; i++) {
+            if (s->streams[i].fd == -1) {
+                n_closed_outputs++;
+                continue;
+            }
+            int w = put_chunk(s, &s->streams[i], buf, rsz, zero, -1);
+            if (w == 0) {
+                if (!s->nosync)
+                    fsync(s->streams[i].fd);
+                if (s->streams[i].fd > 2)
+                    close(s->streams[i].fd);
+                s->streams[i].fd = -1;
+            }
+            bytes_written += w;
+            s->streams[i].written += w;
+        }
+
+        if (n_closed_outputs >= s->n_streams - 1) {
+            complete = false;
+            break;
+        }
+
+        for (int i = 1; i < s->n_streams; i++)
+            sync_chunk(s, &s->streams[i], -1, rsz);
+        blocked_stop(input_stream(s, s->cur_input), t_write);
+
+        if (s->journal) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_nsec - last_save.tv_nsec + 1000000000LL * (now.tv_sec - last_save.tv_sec) >= JOURNAL_INTERVAL_NS) {
+                journal_save(s, offset, zero ? s->zeros : buf, rsz);
+                last_save = now;
+            }
+        }
+
+        if (!s->noautochunk) {
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            int64_t delta = t2.tv_nsec - t1.tv_nsec + 1000000000LL * (t2.tv_sec - t1.tv_sec);
+            chunk_size = tuner_sample(&tuner, rsz, delta);
+            record_chunk_size(chunk_size);
+            t1 = t2;
+        }
+    }
+
+    if (!s->noautochunk) {
+        if (s->chunkcache && tuner.dir == 0)
+            chunk_cache_save(s, tuner_size(&tuner));
+        free(tuner.score);
+    }
+
+    // Once everything has reached the outputs there is nothing left to resume
+    if (s->journal) {
+        complete = complete && (total_size <= 0 || offset >= total_size);
+        for (int i = 1; i < s->n_streams; i++)
+            complete = complete && s->streams[i].fd != -1 && fdatasync(s->streams[i].fd) == 0;
+        if (complete)
+            unlink(s->journal);
+    }
+
+    free(buf);
+    free(s->zeros);
+    s->zeros = NULL;
+}
+
+// Minimal io_uring plumbing, done with raw syscalls so that chunker doesn't need liburing
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned to_submit;
+} Ring;
+
+bool uring_available(void)
+{
+    struct io_uring_params p = {0};
+    int fd = (int)syscall(__NR_io_uring_setup, 1, &p);
+    if (fd < 0)
+        return false;
+    close(fd);
+    return true;
+}
+
+int ring_init(Ring *r, unsigned entries)
+{
+    struct io_uring_params p = {0};
+    memset(r, 0, sizeof(Ring));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    }
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            return -1;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        return -1;
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head  = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+void ring_close(Ring *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    if (r->fd > 0)
+        close(r->fd);
+}
+
+struct io_uring_sqe *ring_get_sqe(Ring *r)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > *r->sq_mask)
+        return NULL;
+
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+int ring_submit_and_wait(Ring *r, unsigned wait_nr)
+{
+    int res = (int)syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res >= 0)
+        r->to_submit -= (unsigned)res;
+    return res;
+}
+
+#define SLOT_FREE     0
+#define SLOT_READING  1
+#define SLOT_WRITING  2
+
+typedef struct {
+    char *buf;
+    int64_t offset;
+    int len;
+    int state;
+    int *written;
+    bool *in_flight;
+    int64_t *issued;
+} Slot;
+
+typedef struct {
+    bool seekable;
+    bool busy;
+    int64_t base;
+    int64_t next_off;
+} UringOutput;
+
+static bool is_seekable(Stream *st)
+{
+    return (st->type == TYPE_REG || st->type == TYPE_BLOCK) && lseek(st->fd, 0, SEEK_CUR) >= 0;
+}
+
+// Keeps up to queue_depth chunks in flight at once, each of which is read then written to every output.
+// Seekable ends are addressed by offset so their requests can complete in any order,
+// while pipes and other streams only ever have one request outstanding, issued in order.
+int copy_uring(Settings *s)
+{
+    int n_outputs = s->n_streams - 1;
+    int qd = s->queue_depth > 0 ? s->queue_depth : 8;
+    int chunk_size = fit_chunk_size(s, s->chunksize > 0 ? s->chunksize : 1024 * 1024);
+
+    Ring ring;
+    if (ring_init(&ring, (unsigned)(qd * (n_outputs + 1))) < 0) {
+        ring_close(&ring);
+        return -1;
+    }
+
+    Slot *slots = calloc(qd, sizeof(Slot));
+    struct iovec *iovs = calloc(qd, sizeof(struct iovec));
+    for (int i = 0; i < qd; i++) {
+        slots[i].buf = alloc_chunk(s, chunk_size);
+        slots[i].written = calloc(n_outputs, sizeof(int));
+        slots[i].in_flight = calloc(n_outputs, sizeof(bool));
+        slots[i].issued = calloc(n_outputs + 1, sizeof(int64_t));
+        iovs[i].iov_base = slots[i].buf;
+        iovs[i].iov_len = chunk_size;
+    }
+
+    // Registered buffers save the kernel from mapping each buffer on every request,
+    // but they count against RLIMIT_MEMLOCK, so carry on without them if that fails
+    bool fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovs, qd) == 0;
+
+    UringOutput *outs = calloc(n_outputs, sizeof(UringOutput));
+    for (int i = 0; i < n_outputs; i++) {
+        Stream *st = &s->streams[i+1];
+        outs[i].seekable = is_seekable(st);
+        outs[i].base = outs[i].seekable ? lseek(st->fd, 0, SEEK_CUR) : 0;
+    }
+
+    bool in_seekable = is_seekable(&s->streams[0]);
+    int64_t in_base = in_seekable ? lseek(s->streams[0].fd, 0, SEEK_CUR) : 0;
+
+    int64_t total_size = copy_size(s);
+    record_chunk_size(chunk_size);
+
+    int64_t next_read = 0;
+    int64_t eof_at = INT64_MAX;
+    int reads_in_flight = 0;
+    int ops_in_flight = 0;
+    bool eof = false;
+
+    while (true) {
+        int n_open = 0;
+        for (int i = 0; i < n_outputs; i++)
+            n_open += s->streams[i+1].fd != -1;
+        if (n_open == 0)
+            eof = true;
+
+        for (int i = 0; i < qd && !eof; i++) {
+            if (slots[i].state != SLOT_FREE)
+                continue;
+            if (!in_seekable && reads_in_flight > 0)
+                break;
+            if (total_size > 0 && next_read >= total_size)
+                break;
+
+            int64_t to_read = total_size > 0 ? total_size - next_read : chunk_size;
+            to_read = to_read < chunk_size ? to_read : chunk_size;
+
+            struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+            if (!sqe)
+                break;
+
+            sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = s->streams[0].fd;
+            sqe->addr = (uint64_t)(uintptr_t)slots[i].buf;
+            sqe->len = (unsigned)(s->streams[0].direct ? round_up(to_read, s->align) : to_read);
+            sqe->off = in_seekable ? (uint64_t)(in_base + next_read) : (uint64_t)-1;
+            sqe->buf_index = (uint16_t)i;
+            sqe->user_data = (uint64_t)i << 16;
+
+            slots[i].offset = next_read;
+            slots[i].len = (int)to_read;
+            slots[i].state = SLOT_READING;
+            slots[i].issued[0] = timer_start();
+            reads_in_flight++;
+            ops_in_flight++;
+            if (in_seekable)
+                next_read += to_read;
+        }
+
+        for (int i = 0; i < qd; i++) {
+            if (slots[i].state != SLOT_WRITING)
+                continue;
+
+            for (int j = 0; j < n_outputs; j++) {
+                Stream *st = &s->streams[j+1];
+                if (st->fd == -1 || slots[i].in_flight[j] || slots[i].written[j] >= slots[i].len)
+                    continue;
+                if (!outs[j].seekable && (outs[j].busy || outs[j].next_off != slots[i].offset + slots[i].written[j]))
+                    continue;
+
+                struct io_uring_sqe *sqe = ring_get_sqe(&ring);
+                if (!sqe)
+                    break;
+
+                int w = slots[i].written[j];
+                sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+                sqe->fd = st->fd;
+                sqe->addr = (uint64_t)(uintptr_t)&slots[i].buf[w];
+                sqe->len = (unsigned)(slots[i].len - w);
+                sqe->off = outs[j].seekable ? (uint64_t)(outs[j].base + slots[i].offset + w) : (uint64_t)-1;
+                sqe->buf_index = (uint16_t)i;
+                sqe->user_data = ((uint64_t)i << 16) | (uint64_t)(j + 1);
+
+                slots[i].in_flight[j] = true;
+                slots[i].issued[j+1] = timer_start();
+                outs[j].busy = true;
+                ops_in_flight++;
+            }
+        }
+
+        if (ops_in_flight == 0)
+            break;
+
+        if (ring_submit_and_wait(&ring, 1) < 0)
+            break;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int idx = (int)(cqe->user_data >> 16);
+            int out = (int)(cqe->user_data & 0xffff) - 1;
+            int res = cqe->res;
+            Slot *slot = &slots[idx];
+            ops_in_flight--;
+
+            // Latencies run from when a request is queued to when its completion is reaped
+            timer_stop(&s->streams[out+1], out < 0 ? OP_READ : OP_WRITE, slot->issued[out+1], res);
+
+            if (out < 0) {
+                reads_in_flight--;
+                if (res <= 0 || slot->offset >= eof_at) {
+                    // Either the end of the input or a read error. Any reads past this point are discarded as they come back
+                    if (slot->offset < eof_at)
+                        eof_at = slot->offset;
+                    eof = true;
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+
+                if (!in_seekable) {
+                    next_read += res;
+                }
+                else if (res < slot->len) {
+                    // A short read from a file or block device means we've hit the end
+                    eof_at = slot->offset + res;
+                    eof = true;
+                }
+                if (res > slot->len)
+                    res = slot->len;
+
+                slot->len = res;
+                slot->state = SLOT_WRITING;
+                memset(slot->written, 0, n_outputs * sizeof(int));
+                bytes_read += res;
+                continue;
+            }
+
+            Stream *st = &s->streams[out+1];
+            slot->in_flight[out] = false;
+            outs[out].busy = false;
+
+            if (res == -EINVAL && st->direct) {
+                // The unaligned end of the copy, which gets written again without O_DIRECT
+                fcntl(st->fd, F_SETFL, fcntl(st->fd, F_GETFL) & ~O_DIRECT);
+                st->direct = false;
+            }
+            else if (res <= 0) {
+                if (st->fd > 2)
+                    close(st->fd);
+                st->fd = -1;
+            }
+            else {
+                slot->written[out] += res;
+                outs[out].next_off += res;
+                bytes_written += res;
+                st->written += res;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        for (int i = 0; i < qd; i++) {
+            if (slots[i].state != SLOT_WRITING)
+                continue;
+
+            bool done = true;
+            for (int j = 0; j < n_outputs && done; j++) {
+                if (slots[i].in_flight[j])
+                    done = false;
+                else if (s->streams[j+1].fd != -1 && slots[i].written[j] < slots[i].len)
+                    done = false;
+            }
+            if (done)
+                slots[i].state = SLOT_FREE;
+        }
+    }
+
+    ring_close(&ring);
+    for (int i = 0; i < qd; i++) {
+        free(slots[i].buf);
+        free(slots[i].written);
+        free(slots[i].in_flight);
+        free(slots[i].issued);
+    }
+    free(slots);
+    free(iovs);
+    free(outs);
+    return 0;
+}
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+}
+
+typedef struct {
+    char *buf;
+    int cap;
+    int len;
+    bool zero;
+    int64_t offset;
+    int64_t index;
+    char *frame;
+    int frame_cap;
+    int frame_len;
+    bool frame_zero;
+    _Atomic uint32_t done;
+} Chunk;
+
+// A single reader publishes chunks into the ring by bumping head, and every consumer keeps its own tail.
+// Both sides only ever touch their own counter, so no locks are needed; the futexes are just for sleeping.
+// The reader marks the end of the input with an empty chunk.
+// The first consumers are the output writers, followed by any checksumming threads.
+// With -compress or -decompress, transform threads turn each chunk into what actually gets written, which the writers wait for.
+// They don't need a tail of their own, since a chunk can't be reused before the writers are done with it
+typedef struct {
+    Settings *s;
+    Chunk *chunks;
+    uint32_t n_chunks;
+    int n_consumers;
+    int n_transforms;
+    _Atomic bool finished;
+    _Atomic uint32_t head;
+    _Atomic uint32_t consumed;
+    _Atomic uint32_t *tails;
+    _Atomic int n_open;
+} Pipeline;
+
+typedef struct {
+    Pipeline *p;
+    int idx;
+    int lane;
+} PipelineWriter;
+
+static Chunk *pipeline_wait(Pipeline *p, uint32_t tail)
+{
+    while (true) {
+        uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+        if (head != tail)
+            return &p->chunks[tail % p->n_chunks];
+        futex_wait(&p->head, head);
+    }
+}
+
+static void pipeline_release(Pipeline *p, int idx, uint32_t tail)
+{
+    atomic_store_explicit(&p->tails[idx], tail, memory_order_release);
+    p->consumed++;
+    futex_wake(&p->consumed);
+}
+
+// Ends a compressed stream with the index of where each frame starts, and the trailer which points at the index.
+// frames holds the stream offset then the raw offset of each frame, and pos is where the index goes
+static void write_frame_index(Settings *s, Stream *st, int64_t *frames, int64_t n_frames, int64_t pos)
+{
+    int len = FRAME_HEADER + (int)n_frames * INDEX_ENTRY + TRAILER_SIZE;
+    uint8_t *buf = malloc(len);
+    uint8_t *entries = &buf[FRAME_HEADER];
+    for (int64_t i = 0; i < n_frames; i++) {
+        put_le64(&entries[i * INDEX_ENTRY], (uint64_t)frames[i * 2]);
+        put_le64(&entries[i * INDEX_ENTRY + 8], (uint64_t)frames[i * 2 + 1]);
+    }
+
+    int n = (int)n_frames * INDEX_ENTRY;
+    put_le32(buf, (uint32_t)n);
+    put_le32(&buf[4], 0);
+    put_le32(&buf[8], CODEC_INDEX);
+    put_le32(&buf[12], frame_crc(entries, n));
+
+    memcpy(&buf[len - TRAILER_SIZE], INDEX_MAGIC, 8);
+    put_le64(&buf[len - 8], (uint64_t)pos);
+
+    int w = put_chunk(s, st, (char*)buf, len, false, -1);
+    bytes_written += w;
+    st->written += w;
+    free(buf);
+}
+
+void *pipeline_write(void *args)
+{
+    PipelineWriter *pw = (PipelineWriter*)args;
+    Pipeline *p = pw->p;
+    Stream *st = &p->s->streams[pw->idx + 1];
+    uint32_t tail = 0;
+
+    // Each output keeps its own index, which only differs from the others if an output gives up early
+    int64_t *frames = NULL;
+    int64_t n_frames = 0, pos = 0, raw_pos = 0;
+    if (p->s->compress && st->fd != -1) {
+        char magic[8];
+        memcpy(magic, FRAME_MAGIC, 8);
+        int w = put_chunk(p->s, st, magic, 8, false, -1);
+        bytes_written += w;
+        st->written += w;
+        pos += w;
+    }
+
+    while (true) {
+        int64_t t = timer_start();
+        Chunk *c = pipeline_wait(p, tail);
+        if (c->len == 0) {
+            if (p->s->compress && st->fd != -1)
+                write_frame_index(p->s, st, frames, n_frames, pos);
+            // Flush here rather than after joining, so that every output syncs at the same time
+            if (st->fd != -1) {
+                if (!p->s->nosync)
+                    fsync(st->fd);
+                if (st->fd > 2)
+                    close(st->fd);
+                st->fd = -1;
+            }
+            break;
+        }
+
+        // An output that has stopped accepting data keeps consuming chunks so that it never holds up the reader.
+        // With -stripe, each output only takes its own share of the chunks
+        bool mine = !p->s->stripe || c->index % (p->s->n_streams - 1) == pw->idx;
+        char *data = c->buf;
+        int len = c->len;
+        bool zero = c->zero;
+        if (p->n_transforms > 0) {
+            uint32_t done;
+            while ((done = atomic_load_explicit(&c->done, memory_order_acquire)) != tail + 1)
+                futex_wait(&c->done, done);
+            data = c->frame;
+            len = c->frame_len;
+            zero = c->frame_zero;
+        }
+        blocked_stop(st, t);
+
+        if (st->fd != -1 && mine) {
+            int w = put_chunk(p->s, st, data, len, zero, -1);
+            bytes_written += w;
+            st->written += w;
+
+            if (p->s->compress && w == len) {
+                if ((n_frames & (n_frames - 1)) == 0)
+                    frames = realloc(frames, (n_frames ? n_frames * 2 : 1) * 2 * sizeof(int64_t));
+                frames[n_frames * 2] = pos;
+                frames[n_frames * 2 + 1] = raw_pos;
+                n_frames++;
+                pos += len;
+                raw_pos += c->len;
+            }
+
+            if (w < len) {
+                if (!p->s->nosync)
+                    fsync(st->fd);
+                if (st->fd > 2)
+                    close(st->fd);
+                st->fd = -1;
+                // Losing one output leaves a hole in every stripe after it, so there's no point carrying on
+                if (p->s->stripe)
+                    p->n_open = 0;
+                else
+                    p->n_open--;
+            }
+            else {
+                sync_chunk(p->s, st, -1, w);
+            }
+        }
+
+        pipeline_release(p, pw->idx, ++tail);
+    }
+
+    free(frames);
+    return NULL;
+}
+
+#define DIGESTS_PER_SEGMENT  65536
+#define MAX_DIGEST_SEGMENTS  65536
+
+typedef struct {
+    int64_t offset;
+    int len;
+    uint8_t digest[32];
+} BlockDigest;
+
+typedef struct {
+    int stream;
+    int64_t offset;
+    int len;
+} Mismatch;
+
+// Checksums of the whole input and of each chunk, the latter being what -verify compares the outputs against.
+// Chunk digests live in fixed-size segments which the reader allocates before publishing a chunk,
+// so the checksumming threads never see the table move underneath them
+struct HashState {
+    int algo;
+    int n_lanes;
+    bool verify;
+    uint8_t digest[32];
+    int digest_len;
+    BlockDigest **segments;
+    int64_t n_blocks;
+    pthread_mutex_t lock;
+    Mismatch *mismatches;
+    int n_mismatches;
+    int n_verified;
+};
+
+// Thread pools are sized to the number of CPUs, up to a point
+static int cpu_count(void)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return n_cpus < 1 ? 1 : n_cpus > 8 ? 8 : (int)n_cpus;
+}
+
+HashState *make_hash_state(int algo, bool verify)
+{
+    HashState *h = calloc(1, sizeof(HashState));
+    h->algo = algo;
+    h->verify = verify;
+    h->segments = calloc(MAX_DIGEST_SEGMENTS, sizeof(BlockDigest*));
+    pthread_mutex_init(&h->lock, NULL);
+
+    h->n_lanes = cpu_count();
+    return h;
+}
+
+static BlockDigest *block_digest(HashState *h, int64_t index)
+{
+    return &h->segments[index / DIGESTS_PER_SEGMENT][index % DIGESTS_PER_SEGMENT];
+}
+
+// One thread works through the whole input in order, while each of the others takes every n_lanes-th chunk
+void *pipeline_hash(void *args)
+{
+    PipelineWriter *pw = (PipelineWriter*)args;
+    Pipeline *p = pw->p;
+    HashState *h = p->s->hash;
+    uint32_t tail = 0;
+
+    HashCtx whole;
+    hash_init(&whole, h->algo);
+
+    while (true) {
+        Chunk *c = pipeline_wait(p, tail);
+        if (c->len == 0)
+            break;
+
+        const char *data = c->zero ? p->s->zeros : c->buf;
+        if (pw->lane < 0) {
+            hash_update(&whole, data, c->len);
+        }
+        else if (c->index % h->n_lanes == pw->lane) {
+            BlockDigest *b = block_digest(h, c->index);
+            HashCtx ctx;
+            hash_init(&ctx, h->algo);
+            hash_update(&ctx, data, c->len);
+            hash_final(&ctx, b->digest);
+            b->offset = c->offset;
+            b->len = c->len;
+        }
+
+        pipeline_release(p, pw->idx, ++tail);
+    }
+
+    if (pw->lane < 0)
+        h->digest_len = hash_final(&whole, h->digest);
+    return NULL;
+}
+
+// Compresses or decompresses every n_transforms-th chunk, starting from its lane.
+// Jumping straight to its own chunks means a transform thread can never be lapped by the reader,
+// as the writers can't get past a chunk until it has been transformed
+void *pipeline_transform(void *args)
+{
+    PipelineWriter *pw = (PipelineWriter*)args;
+    Pipeline *p = pw->p;
+    Settings *s = p->s;
+    uint32_t *table = s->compress == CODEC_LZ4 ? malloc(sizeof(uint32_t) << LZ4_HASH_BITS) : NULL;
+
+    for (uint32_t seq = (uint32_t)pw->lane; ; seq += (uint32_t)p->n_transforms) {
+        while (true) {
+            bool finished = atomic_load_explicit(&p->finished, memory_order_acquire);
+            uint32_t head = atomic_load_explicit(&p->head, memory_order_acquire);
+            if ((int32_t)(head - seq) > 0)
+                break;
+            if (finished) {
+                free(table);
+                return NULL;
+            }
+            futex_wait(&p->head, head);
+        }
+
+        Chunk *c = &p->chunks[seq % p->n_chunks];
+        if (c->len == 0)
+            break;
+
+        if (s->compress) {
+            int need = frame_bound(c->len);
+            if (c->frame_cap < need) {
+                free(c->frame);
+                c->frame = alloc_chunk(s, need);
+                c->frame_cap = need;
+            }
+            c->frame_len = encode_frame(s->compress, c->zero ? s->zeros : c->buf, c->len, (uint8_t*)c->frame, table);
+            c->frame_zero = false;
+        }
+        else {
+            int raw_len = (int)get_le32((uint8_t*)&c->buf[4]);
+            if (c->frame_cap < raw_len) {
+                free(c->frame);
+                c->frame = alloc_chunk(s, raw_len);
+                c->frame_cap = raw_len;
+            }
+            // A bad frame still takes up its space in the output, so that everything after it lands in the right place
+            if (decode_frame((uint8_t*)c->buf, c->len, c->frame, raw_len) < 0) {
+                memset(c->frame, 0, raw_len);
+                bad_frames++;
+            }
+            c->frame_len = raw_len;
+            c->frame_zero = s->sparse && is_zero(c->frame, raw_len);
+        }
+
+        atomic_store_explicit(&c->done, seq + 1, memory_order_release);
+        futex_wake(&c->done);
+    }
+
+    free(table);
+    return NULL;
+}
+
+static bool read_exact(int fd, char *buf, int len)
+{
+    int got = 0;
+    while (got < len) {
+        ssize_t res = read(fd, &buf[got], len - got);
+        if (res <= 0)
+            return false;
+        got += (int)res;
+    }
+    return true;
+}
+
+// Reads the next frame of a compressed stream into a chunk, growing it if need be.
+// Returns the size of the frame, or 0 once the index is reached or the stream ends
+static int read_frame(Settings *s, Chunk *c)
+{
+    int fd = s->streams[0].fd;
+    if (!read_exact(fd, c->buf, FRAME_HEADER))
+        return 0;
+
+    int n = (int)get_le32((uint8_t*)c->buf);
+    int raw_len = (int)get_le32((uint8_t*)&c->buf[4]);
+    int codec = (int)get_le32((uint8_t*)&c->buf[8]);
+    if (codec == CODEC_INDEX)
+        return 0;
+    if (n < 0 || raw_len < 0 || raw_len > MAX_CHUNK || n > frame_bound(MAX_CHUNK)) {
+        bad_frames++;
+        return 0;
+    }
+
+    if (c->cap < FRAME_HEADER + n) {
+        char *buf = alloc_chunk(s, FRAME_HEADER + n);
+        memcpy(buf, c->buf, FRAME_HEADER);
+        free(c->buf);
+        c->buf = buf;
+        c->cap = FRAME_HEADER + n;
+    }
+    if (!read_exact(fd, &c->buf[FRAME_HEADER], n)) {
+        bad_frames++;
+        return 0;
+    }
+    return FRAME_HEADER + n;
+}
+
+// Overlaps reading from the input with writing to the outputs, so the copy runs at the speed of the slowest side
+// rather than at the speed of both sides added together.
+// Each output gets its own writer, which may trail the reader by up to n_chunks chunks.
+void copy_pipeline(Settings *s)
+{
+    int n_outputs = s->n_streams - 1;
+    int chunk_size = fit_chunk_size(s, s->chunksize > 0 ? s->chunksize : 1024 * 1024);
+    HashState *h = s->hash;
+
+    Pipeline p = {0};
+    p.s = s;
+    p.n_chunks = s->ring_size > 0 ? (uint32_t)s->ring_size : 8;
+    if (s->lag > 0)
+        p.n_chunks = s->lag > chunk_size ? (uint32_t)(s->lag / chunk_size) : 1;
+    p.chunks = calloc(p.n_chunks, sizeof(Chunk));
+    for (uint32_t i = 0; i < p.n_chunks; i++) {
+        p.chunks[i].buf = alloc_chunk(s, chunk_size);
+        p.chunks[i].cap = chunk_size;
+    }
+    // Decompressed frames can be up to MAX_CHUNK long, and a zero one is written from here
+    int zeros_size = s->decompress ? MAX_CHUNK : chunk_size;
+    if (s->sparse) {
+        s->zeros = alloc_chunk(s, zeros_size);
+        memset(s->zeros, 0, zeros_size);
+    }
+    p.n_consumers = n_outputs + (h ? h->n_lanes + 1 : 0);
+    p.tails = calloc(p.n_consumers, sizeof(_Atomic uint32_t));
+    p.n_open = n_outputs;
+
+    PipelineWriter *writers = calloc(p.n_consumers, sizeof(PipelineWriter));
+    pthread_t *tids = calloc(p.n_consumers, sizeof(pthread_t));
+    for (int i = 0; i < p.n_consumers; i++) {
+        writers[i].p = &p;
+        writers[i].idx = i;
+        writers[i].lane = i - n_outputs - 1;
+        pthread_create(&tids[i], NULL, i < n_outputs ? pipeline_write : pipeline_hash, &writers[i]);
+    }
+
+    p.n_transforms = s->compress || s->decompress ? cpu_count() : 0;
+    PipelineWriter *transforms = calloc(p.n_transforms, sizeof(PipelineWriter));
+    pthread_t *transform_tids = calloc(p.n_transforms, sizeof(pthread_t));
+    for (int i = 0; i < p.n_transforms; i++) {
+        transforms[i].p = &p;
+        transforms[i].lane = i;
+        pthread_create(&transform_tids[i], NULL, pipeline_transform, &transforms[i]);
+    }
+
+    // A compressed stream is read frame by frame rather than in chunks, so the input has to be read exactly
+    bool readable = true;
+    if (s->decompress) {
+        Stream *in = &s->streams[0];
+        if (in->direct) {
+            fcntl(in->fd, F_SETFL, fcntl(in->fd, F_GETFL) & ~O_DIRECT);
+            in->direct = false;
+        }
+        char magic[8];
+        if (!read_exact(in->fd, magic, 8) || memcmp(magic, FRAME_MAGIC, 8)) {
+            bad_frames++;
+            readable = false;
+        }
+    }
+
+    int64_t total_size = copy_size(s);
+
+    int64_t offset = 0;
+    int64_t data_end = 0;
+    int64_t index = 0;
+    uint32_t head = 0;
+    record_chunk_size(chunk_size);
+    while (true) {
+        int64_t t = timer_start();
+        while (true) {
+            uint32_t consumed = atomic_load_explicit(&p.consumed, memory_order_acquire);
+            uint32_t min_tail = head;
+            for (int i = 0; i < p.n_consumers; i++) {
+                uint32_t t = atomic_load_explicit(&p.tails[i], memory_order_acquire);
+                if (head - t > head - min_tail)
+                    min_tail = t;
+            }
+            if (head - min_tail < p.n_chunks)
+                break;
+            futex_wait(&p.consumed, consumed);
+        }
+        blocked_stop(input_stream(s, s->cur_input), t);
+
+        Chunk *c = &p.chunks[head % p.n_chunks];
+        c->len = 0;
+
+        if (s->decompress) {
+            c->zero = false;
+            t = timer_start();
+            if (p.n_open > 0 && readable)
+                c->len = read_frame(s, c);
+            timer_stop(&s->streams[0], OP_READ, t, c->len);
+            if (c->len > 0) {
+                c->offset = offset;
+                c->index = index++;
+                offset += c->len;
+                bytes_read += c->len;
+            }
+        }
+        else if (p.n_open > 0 && (total_size <= 0 || offset < total_size)) {
+            int64_t to_read = total_size > 0 ? (total_size - offset) : chunk_size;
+            to_read = to_read < chunk_size ? to_read : chunk_size;
+
+            int rsz = s->stripe ? fill_chunk(s, c->buf, (int)to_read, &c->zero, &data_end)
+                                : next_chunk(s, c->buf, (int)to_read, &c->zero, &data_end);
+            if (rsz > 0) {
+                c->len = rsz;
+                c->offset = offset;
+                c->index = index++;
+                offset += rsz;
+                bytes_read += rsz;
+
+                if (h) {
+                    int64_t seg = c->index / DIGESTS_PER_SEGMENT;
+                    if (seg >= MAX_DIGEST_SEGMENTS) {
+                        c->len = 0;
+                        index--;
+                    }
+                    else if (!h->segments[seg])
+                        h->segments[seg] = calloc(DIGESTS_PER_SEGMENT, sizeof(BlockDigest));
+                }
+            }
+        }
+
+        head++;
+        atomic_store_explicit(&p.head, head, memory_order_release);
+        if (c->len == 0)
+            atomic_store_explicit(&p.finished, true, memory_order_release);
+        futex_wake(&p.head);
+
+        if (c->len == 0)
+            break;
+    }
+
+    for (int i = 0; i < p.n_consumers; i++)
+        pthread_join(tids[i], NULL);
+    for (int i = 0; i < p.n_transforms; i++)
+        pthread_join(transform_tids[i], NULL);
+
+    if (h)
+        h->n_blocks = index;
+
+    for (uint32_t i = 0; i < p.n_chunks; i++) {
+        free(p.chunks[i].buf);
+        free(p.chunks[i].frame);
+    }
+    free(p.chunks);
+    free((void*)p.tails);
+    free(s->zeros);
+    s->zeros = NULL;
+    free(writers);
+    free(tids);
+    free(transforms);
+    free(transform_tids);
+}
+
+typedef struct {
+    Settings *s;
+    int stream;
+    int fd;
+    int direct_fd;
+    _Atomic int64_t *next;
+} VerifyWorker;
+
+void *verify_worker(void *args)
+{
+    VerifyWorker *vw = (VerifyWorker*)args;
+    HashState *h = vw->s->hash;
+    int max_len = 0;
+    for (int64_t i = 0; i < h->n_blocks; i++) {
+        if (block_digest(h, i)->len > max_len)
+            max_len = block_digest(h, i)->len;
+    }
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, 4096, round_up(max_len, 4096)) != 0)
+        return NULL;
+    char *buf = mem;
+
+    while (true) {
+        int64_t idx = (*vw->next)++;
+        if (idx >= h->n_blocks)
+            break;
+
+        // Chunks read from a pipe can start anywhere, so only aligned ones go through the O_DIRECT descriptor
+        BlockDigest *b = block_digest(h, idx);
+        bool direct = vw->direct_fd != -1 && b->offset % 4096 == 0;
+        int want = direct ? (int)round_up(b->len, 4096) : b->len;
+        int got = 0;
+        while (got < b->len) {
+            ssize_t res = pread(direct ? vw->direct_fd : vw->fd, &buf[got], want - got, b->offset + got);
+            if (res < 0 && direct) {
+                direct = false;
+                want = b->len;
+                continue;
+            }
+            if (res <= 0)
+                break;
+            got += (int)res;
+            if (got % 4096 != 0) {
+                direct = false;
+                want = b->len;
+            }
+        }
+
+        bool ok = got >= b->len;
+        if (ok) {
+            uint8_t digest[32];
+            HashCtx ctx;
+            hash_init(&ctx, h->algo);
+            hash_update(&ctx, buf, b->len);
+            int len = hash_final(&ctx, digest);
+            ok = memcmp(digest, b->digest, len) == 0;
+        }
+        bytes_verified += b->len;
+
+        if (!ok) {
+            pthread_mutex_lock(&h->lock);
+            h->mismatches = realloc(h->mismatches, (h->n_mismatches + 1) * sizeof(Mismatch));
+            h->mismatches[h->n_mismatches++] = (Mismatch){vw->stream, b->offset, b->len};
+            pthread_mutex_unlock(&h->lock);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Reads back every output that can be reopened by name, bypassing the page cache so that what gets compared
+// is what actually reached the device. Several chunks are read at once to keep the device busy
+void verify_outputs(Settings *s)
+{
+    HashState *h = s->hash;
+    int n_workers = s->queue_depth > 0 ? s->queue_depth : 8;
+    VerifyWorker *workers = calloc(n_workers, sizeof(VerifyWorker));
+    pthread_t *tids = calloc(n_workers, sizeof(pthread_t));
+
+    for (int i = 1; i < s->n_streams; i++) {
+        Stream *st = &s->streams[i];
+        if (st->type != TYPE_REG && st->type != TYPE_BLOCK)
+            continue;
+
+        int fd = open(st->name, O_RDONLY);
+        if (fd < 0)
+            continue;
+        int direct_fd = open(st->name, O_RDONLY | O_DIRECT);
+        if (direct_fd < 0)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        _Atomic int64_t next = 0;
+        for (int j = 0; j < n_workers; j++) {
+            workers[j] = (VerifyWorker){s, i, fd, direct_fd, &next};
+            pthread_create(&tids[j], NULL, verify_worker, &workers[j]);
+        }
+        for (int j = 0; j < n_workers; j++)
+            pthread_join(tids[j], NULL);
+
+        close(fd);
+        if (direct_fd >= 0)
+            close(direct_fd);
+        h->n_verified++;
+    }
+
+    free(workers);
+    free(tids);
+}
+
+static int compare_mismatches(const void *a, const void *b)
+{
+    const Mismatch *x = a, *y = b;
+    if (x->stream != y->stream)
+        return x->stream - y->stream;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Prints the checksum of the input in the same format as sha256sum and friends, followed by the results of -verify.
+// Returns the number of mismatched chunks
+int print_hash_results(Settings *s, FILE *output)
+{
+    HashState *h = s->hash;
+    for (int i = 0; i < h->digest_len; i++)
+        fprintf(output, "%02x", h->digest[i]);
+    fprintf(output, "  %s\n", s->streams[0].name);
+
+    if (!h->verify)
+        return 0;
+
+    if (h->n_mismatches)
+        qsort(h->mismatches, h->n_mismatches, sizeof(Mismatch), compare_mismatches);
+    for (int i = 0; i < h->n_mismatches; i++) {
+        Mismatch *m = &h->mismatches[i];
+        fprintf(output, "Mismatch in %s at offset %ld (%d bytes)\n", s->streams[m->stream].name, m->offset, m->len);
+    }
+    fprintf(output, "Verified %d output%s against %ld chunks: %d mismatched\n",
+        h->n_verified, h->n_verified == 1 ? "" : "s", h->n_blocks, h->n_mismatches);
+    return h->n_mismatches;
+}
+
+static bool kernel_refused(int err)
+{
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF || err == ESPIPE;
+}
+
+static void close_output(Settings *s, Stream *st)
+{
+    if (!s->nosync)
+        fsync(st->fd);
+    if (st->fd > 2)
+        close(st->fd);
+    st->fd = -1;
+}
+
+static void make_pipe(int fds[2], int *capacity)
+{
+    fds[0] = fds[1] = -1;
+    if (pipe(fds) < 0)
+        return;
+    fcntl(fds[1], F_SETPIPE_SZ, *capacity);
+    int sz = fcntl(fds[1], F_GETPIPE_SZ);
+    if (sz > 0 && sz < *capacity)
+        *capacity = sz;
+}
+
+static bool write_all(int fd, char *buf, int64_t len)
+{
+    int64_t w = 0;
+    while (w < len) {
+        ssize_t res = write(fd, &buf[w], len - w);
+        if (res <= 0)
+            return false;
+        w += res;
+    }
+    return true;
+}
+
+typedef struct {
+    Settings *s;
+    Stream *out;
+    int stage;
+    int chunk_size;
+} SpliceWriter;
+
+// Drains one output's stage pipe into that output. If the output can't be spliced to, the data goes through a buffer instead
+void *splice_write(void *args)
+{
+    SpliceWriter *sw = (SpliceWriter*)args;
+    Stream *out = sw->out;
+    char *buf = NULL;
+
+    while (true) {
+        ssize_t res;
+        if (out->fd == -1) {
+            char discard[4096];
+            res = read(sw->stage, discard, sizeof(discard));
+            if (res <= 0)
+                break;
+            continue;
+        }
+
+        int64_t t = timer_start();
+        if (!buf) {
+            res = splice(sw->stage, NULL, out->fd, NULL, sw->chunk_size, SPLICE_F_MOVE);
+            if (res < 0 && kernel_refused(errno)) {
+                buf = malloc(sw->chunk_size);
+                continue;
+            }
+        }
+        else {
+            res = read(sw->stage, buf, sw->chunk_size);
+            if (res > 0 && !write_all(out->fd, buf, res))
+                res = -1;
+        }
+
+        if (res == 0)
+            break;
+        if (res < 0) {
+            close_output(sw->s, out);
+            continue;
+        }
+
+        timer_stop(out, OP_WRITE, t, res);
+        bytes_written += res;
+        out->written += res;
+        sync_chunk(sw->s, out, -1, (int)res);
+    }
+
+    if (out->fd != -1)
+        close_output(sw->s, out);
+    free(buf);
+    return NULL;
+}
+
+// Moves data between file descriptors without it ever passing through user space.
+// A single output is fed with copy_file_range between files, sendfile from a file to anything else,
+// or splice if either end is a pipe. Anything else goes through a pipe of our own, which is duplicated with tee
+// into a stage pipe per output, each drained by its own thread so that a slow output doesn't hold up the rest.
+// Returns -1 if the kernel won't do it for this combination of streams, before anything has been transferred.
+int copy_zerocopy(Settings *s)
+{
+    int n_outputs = s->n_streams - 1;
+    Stream *in = &s->streams[0];
+    int in_type = real_type(in);
+    int out_type = real_type(&s->streams[1]);
+
+    int chunk_size = s->chunksize > 0 ? s->chunksize : MAX_CHUNK;
+    if (chunk_size > MAX_CHUNK)
+        chunk_size = MAX_CHUNK;
+
+    int64_t total_size = copy_size(s);
+
+    bool in_file = in_type == TYPE_REG || in_type == TYPE_BLOCK;
+    bool out_file = out_type == TYPE_REG || out_type == TYPE_BLOCK;
+    int method = 0;
+    if (n_outputs == 1 && in_file && out_file)
+        method = 1;
+    else if (n_outputs == 1 && in_file)
+        method = 2;
+    else if (n_outputs == 1 && (in_type == TYPE_FIFO || out_type == TYPE_FIFO))
+        method = 3;
+    else
+        method = 4;
+
+    int mid[2] = {-1, -1};
+    int (*stages)[2] = NULL;
+    SpliceWriter *writers = NULL;
+    pthread_t *tids = NULL;
+    char *buf = NULL;
+    ssize_t *teed = NULL;
+    if (method == 4) {
+        make_pipe(mid, &chunk_size);
+        stages = calloc(n_outputs, sizeof(int[2]));
+        for (int i = 0; i < n_outputs; i++)
+            make_pipe(stages[i], &chunk_size);
+        teed = calloc(n_outputs, sizeof(ssize_t));
+    }
+
+    int64_t offset = 0;
+    int res = 0;
+    while (total_size <= 0 || offset < total_size) {
+        int64_t to_move = total_size > 0 ? (total_size - offset) : chunk_size;
+        to_move = to_move < chunk_size ? to_move : chunk_size;
+
+        // A transfer between the input and a single output counts as a write, since it finishes once the data has been written
+        Stream *out = &s->streams[1];
+        ssize_t moved = 0;
+        int64_t t = timer_start();
+        if (method == 1)
+            moved = copy_file_range(in->fd, NULL, out->fd, NULL, (size_t)to_move, 0);
+        else if (method == 2)
+            moved = sendfile(out->fd, in->fd, NULL, (size_t)to_move);
+        else if (method == 3)
+            moved = splice(in->fd, NULL, out->fd, NULL, (size_t)to_move, SPLICE_F_MOVE);
+        else
+            moved = splice(in->fd, NULL, mid[1], NULL, (size_t)to_move, SPLICE_F_MOVE);
+
+        if (moved < 0 && offset == 0 && kernel_refused(errno)) {
+            res = -1;
+            break;
+        }
+        if (moved <= 0)
+            break;
+        timer_stop(method == 4 ? in : out, method == 4 ? OP_READ : OP_WRITE, t, moved);
+        if (method != 4)
+            count_bytes(in, moved);
+
+        offset += moved;
+        bytes_read += moved;
+
+        if (method != 4) {
+            bytes_written += moved;
+            out->written += moved;
+            sync_chunk(s, out, -1, (int)moved);
+            continue;
+        }
+
+        if (!tids) {
+            // Only start the writers once the kernel has agreed to splice from the input
+            writers = calloc(n_outputs, sizeof(SpliceWriter));
+            tids = calloc(n_outputs, sizeof(pthread_t));
+            for (int i = 0; i < n_outputs; i++) {
+                writers[i] = (SpliceWriter){s, &s->streams[i+1], stages[i][0], chunk_size};
+                pthread_create(&tids[i], NULL, splice_write, &writers[i]);
+            }
+        }
+
+        // Every output but the last gets a duplicate of the data, then the last one consumes it.
+        // tee blocks while a stage is full, and may stop short if the stage is only partly empty,
+        // in which case the rest of the data has to be read out of our pipe and written to that stage instead.
+        bool any_partial = false;
+        for (int i = 0; i < n_outputs - 1; i++) {
+            ssize_t t = tee(mid[0], stages[i][1], (size_t)moved, 0);
+            teed[i] = t > 0 ? t : 0;
+            any_partial |= teed[i] < moved;
+        }
+
+        if (!any_partial) {
+            for (ssize_t left = moved; left > 0; ) {
+                ssize_t r = splice(mid[0], NULL, stages[n_outputs-1][1], NULL, (size_t)left, SPLICE_F_MOVE);
+                if (r <= 0)
+                    break;
+                left -= r;
+            }
+            continue;
+        }
+
+        if (!buf)
+            buf = malloc(chunk_size);
+
+        ssize_t got = 0;
+        while (got < moved) {
+            ssize_t r = read(mid[0], &buf[got], moved - got);
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        teed[n_outputs-1] = 0;
+        for (int i = 0; i < n_outputs; i++) {
+            if (teed[i] < got)
+                write_all(stages[i][1], &buf[teed[i]], got - teed[i]);
+        }
+    }
+
+    if (method == 4) {
+        for (int i = 0; i < n_outputs; i++)
+            close(stages[i][1]);
+        for (int i = 0; tids && i < n_outputs; i++)
+            pthread_join(tids[i], NULL);
+        for (int i = 0; i < n_outputs; i++)
+            close(stages[i][0]);
+        close(mid[0]);
+        close(mid[1]);
+        free(stages);
+        free(writers);
+        free(tids);
+        free(teed);
+        free(buf);
+    }
+    return res;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t next;
+    int64_t end;
+} Range;
+
+typedef struct {
+    Settings *s;
+    Range *ranges;
+    int n_ranges;
+    int idx;
+    int chunk_size;
+    _Atomic bool *no_cfr;
+} RangeWorker;
+
+// Takes the next chunk from a worker's own range. Once that runs out, the back half of whichever range has the most left is taken over
+static bool claim_chunk(RangeWorker *rw, int64_t *start, int *len)
+{
+    Range *own = &rw->ranges[rw->idx];
+    while (true) {
+        pthread_mutex_lock(&own->lock);
+        if (own->next < own->end) {
+            *start = own->next;
+            *len = own->end - own->next < rw->chunk_size ? (int)(own->end - own->next) : rw->chunk_size;
+            own->next += *len;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+        pthread_mutex_unlock(&own->lock);
+
+        int victim = -1;
+        int64_t most = rw->chunk_size;
+        for (int i = 0; i < rw->n_ranges; i++) {
+            int64_t left = rw->ranges[i].end - rw->ranges[i].next;
+            if (left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        Range *r = &rw->ranges[victim];
+        pthread_mutex_lock(&r->lock);
+        int64_t left = r->end - r->next;
+        int64_t mid = r->next + round_up(left / 2, rw->chunk_size);
+        bool stolen = left > rw->chunk_size && mid < r->end;
+        int64_t end = r->end;
+        if (stolen)
+            r->end = mid;
+        pthread_mutex_unlock(&r->lock);
+
+        if (stolen) {
+            pthread_mutex_lock(&own->lock);
+            own->next = mid;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+        }
+    }
+}
+
+// Each worker gets its own view of the outputs, so that -diffwrite has a read-back buffer per thread
+static Stream *worker_outputs(Settings *s)
+{
+    int n_outputs = s->n_streams - 1;
+    Stream *outs = calloc(n_outputs, sizeof(Stream));
+    memcpy(outs, &s->streams[1], n_outputs * sizeof(Stream));
+    for (int i = 0; i < n_outputs; i++) {
+        outs[i].scratch = NULL;
+        outs[i].scratch_len = 0;
+        outs[i].wb_offs = NULL;
+        outs[i].wb_lens = NULL;
+        outs[i].wb_count = 0;
+    }
+    return outs;
+}
+
+static void free_worker_outputs(Settings *s, Stream *outs)
+{
+    for (int i = 0; i < s->n_streams - 1; i++) {
+        free(outs[i].scratch);
+        free_writeback(&outs[i]);
+    }
+    free(outs);
+}
+
+void *copy_range_worker(void *args)
+{
+    RangeWorker *rw = (RangeWorker*)args;
+    Settings *s = rw->s;
+    int n_outputs = s->n_streams - 1;
+    Stream *outs = worker_outputs(s);
+
+    bool use_cfr = n_outputs == 1 && !s->sparse && !s->diffwrite && !s->direct && !s->nozerocopy;
+    char *buf = alloc_chunk(s, rw->chunk_size);
+
+    int64_t start;
+    int len;
+    while (claim_chunk(rw, &start, &len)) {
+        // With -concat, a chunk stops at the end of its input, and the rest of it goes back to be claimed again
+        int64_t pos = start;
+        Stream *in = input_at(s, &pos);
+        if (s->n_inputs > 1 && in->size - pos > 0 && in->size - pos < len) {
+            len = (int)(in->size - pos);
+            Range *own = &rw->ranges[rw->idx];
+            pthread_mutex_lock(&own->lock);
+            own->next = start + len;
+            pthread_mutex_unlock(&own->lock);
+        }
+
+        if (use_cfr && !*rw->no_cfr) {
+            loff_t in_off = pos, out_off = start;
+            int done = 0;
+            int64_t t = timer_start();
+            while (done < len) {
+                ssize_t res = copy_file_range(in->fd, &in_off, outs[0].fd, &out_off, len - done, 0);
+                if (res <= 0)
+                    break;
+                done += (int)res;
+            }
+            timer_stop(&outs[0], OP_WRITE, t, done);
+            count_bytes(in, done);
+            bytes_read += done;
+            bytes_written += done;
+            s->streams[1].written += done;
+            if (done == len)
+                continue;
+
+            *rw->no_cfr = true;
+            start += done;
+            pos += done;
+            len -= done;
+        }
+
+        bool zero = false;
+        int got = 0;
+        if (s->sparse && in->type == TYPE_REG) {
+            off_t data = lseek(in->fd, pos, SEEK_DATA);
+            if (data < 0 && errno == ENXIO)
+                data = pos + len;
+            if (data > pos) {
+                got = data - pos < len ? (int)(data - pos) : len;
+                zero = true;
+            }
+        }
+
+        if (!zero) {
+            int64_t t = timer_start();
+            int want = in->direct ? (int)round_up(len, s->align) : len;
+            while (got < len) {
+                ssize_t res = pread(in->fd, &buf[got], want - got, pos + got);
+                // Inputs after the first one in a -concat don't start on a chunk boundary, so their chunks can be misaligned
+                if (res < 0 && errno == EINVAL && in->direct) {
+                    fcntl(in->fd, F_SETFL, fcntl(in->fd, F_GETFL) & ~O_DIRECT);
+                    in->direct = false;
+                    want = len;
+                    continue;
+                }
+                if (res <= 0)
+                    break;
+                got += (int)res;
+            }
+            if (got > len)
+                got = len;
+            timer_stop(in, OP_READ, t, got);
+            if (got <= 0)
+                break;
+            bytes_read += got;
+            zero = s->sparse && is_zero(buf, got);
+        }
+
+        // Whatever part of the chunk wasn't covered (a hole cut short, or a short read) goes back to be claimed again.
+        // Thieves only ever move the end of a range, so the chunk is still at the front of this worker's range
+        if (got < len) {
+            Range *own = &rw->ranges[rw->idx];
+            pthread_mutex_lock(&own->lock);
+            own->next = start + got;
+            pthread_mutex_unlock(&own->lock);
+        }
+
+        for (int i = 0; i < n_outputs; i++) {
+            if (s->streams[i+1].fd == -1)
+                continue;
+            int w = put_chunk(s, &outs[i], buf, got, zero, start);
+            bytes_written += w;
+            s->streams[i+1].written += w;
+        }
+
+        for (int i = 0; i < n_outputs; i++) {
+            if (s->streams[i+1].fd != -1)
+                sync_chunk(s, &outs[i], start, got);
+        }
+    }
+
+    free_worker_outputs(s, outs);
+    free(buf);
+    return NULL;
+}
+
+// Splits the copy into one range per worker, each of which is copied with pread/pwrite (or copy_file_range).
+// Workers that finish early take over half of whatever is left of the slowest range, so the copy keeps every worker busy
+// until the end, which is what RAID arrays and NVMe drives need to reach their full speed
+void copy_ranges(Settings *s)
+{
+    int n_jobs = s->jobs;
+    int chunk_size = fit_chunk_size(s, s->chunksize > 0 ? s->chunksize : 1024 * 1024);
+
+    int64_t total_size = copy_size(s);
+
+    if (s->sparse) {
+        s->zeros = alloc_chunk(s, chunk_size);
+        memset(s->zeros, 0, chunk_size);
+    }
+
+    // Give file outputs their final size up front, so that no worker ever has to extend them for -sparse
+    for (int i = 1; i < s->n_streams; i++) {
+        Stream *st = &s->streams[i];
+        if (st->type == TYPE_REG && st->size < total_size && ftruncate(st->fd, total_size) == 0)
+            st->size = total_size;
+    }
+
+    Range *ranges = calloc(n_jobs, sizeof(Range));
+    int64_t per_job = round_up((total_size + n_jobs - 1) / n_jobs, chunk_size);
+    for (int i = 0; i < n_jobs; i++) {
+        pthread_mutex_init(&ranges[i].lock, NULL);
+        ranges[i].next = i * per_job < total_size ? i * per_job : total_size;
+        ranges[i].end = (i + 1) * per_job < total_size ? (i + 1) * per_job : total_size;
+    }
+
+    _Atomic bool no_cfr = false;
+    RangeWorker *workers = calloc(n_jobs, sizeof(RangeWorker));
+    pthread_t *tids = calloc(n_jobs, sizeof(pthread_t));
+    for (int i = 0; i < n_jobs; i++) {
+        workers[i] = (RangeWorker){s, ranges, n_jobs, i, chunk_size, &no_cfr};
+        pthread_create(&tids[i], NULL, copy_range_worker, &workers[i]);
+    }
+    for (int i = 0; i < n_jobs; i++)
+        pthread_join(tids[i], NULL);
+
+    for (int i = 0; i < n_jobs; i++)
+        pthread_mutex_destroy(&ranges[i].lock);
+    free(ranges);
+    free(workers);
+    free(tids);
+    free(s->zeros);
+    s->zeros = NULL;
+}
+
+typedef struct {
+    Settings *s;
+    const uint8_t *index;
+    int64_t n_frames;
+    int64_t index_pos;
+    _Atomic int64_t *next;
+} FrameWorker;
+
+static bool pread_exact(int fd, void *buf, int len, int64_t off)
+{
+    int got = 0;
+    while (got < len) {
+        ssize_t res = pread(fd, &((char*)buf)[got], len - got, off + got);
+        if (res <= 0)
+            return false;
+        got += (int)res;
+    }
+    return true;
+}
+
+void *copy_frame_worker(void *args)
+{
+    FrameWorker *fw = (FrameWorker*)args;
+    Settings *s = fw->s;
+    int n_outputs = s->n_streams - 1;
+    Stream *outs = worker_outputs(s);
+
+    char *frame = NULL, *raw = NULL;
+    int frame_cap = 0, raw_cap = 0;
+    while (true) {
+        int64_t i = (*fw->next)++;
+        if (i >= fw->n_frames)
+            break;
+
+        int64_t pos = (int64_t)get_le64(&fw->index[i * INDEX_ENTRY]);
+        int64_t raw_off = (int64_t)get_le64(&fw->index[i * INDEX_ENTRY + 8]);
+        int64_t end = i + 1 < fw->n_frames ? (int64_t)get_le64(&fw->index[(i + 1) * INDEX_ENTRY]) : fw->index_pos;
+        if (end - pos < FRAME_HEADER || end - pos > frame_bound(MAX_CHUNK)) {
+            bad_frames++;
+            continue;
+        }
+
+        int len = (int)(end - pos);
+        if (frame_cap < len) {
+            free(frame);
+            frame = malloc(len);
+            frame_cap = len;
+        }
+        if (!pread_exact(s->streams[0].fd, frame, len, pos)) {
+            bad_frames++;
+            continue;
+        }
+        bytes_read += len;
+
+        int raw_len = (int)get_le32((uint8_t*)&frame[4]);
+        if (raw_len < 0 || raw_len > MAX_CHUNK) {
+            bad_frames++;
+            continue;
+        }
+        if (raw_cap < raw_len) {
+            free(raw);
+            raw = alloc_chunk(s, raw_len);
+            raw_cap = raw_len;
+        }
+        if (decode_frame((uint8_t*)frame, len, raw, raw_len) < 0) {
+            memset(raw, 0, raw_len);
+            bad_frames++;
+        }
+
+        bool zero = s->sparse && is_zero(raw, raw_len);
+        for (int j = 0; j < n_outputs; j++) {
+            if (s->streams[j+1].fd == -1)
+                continue;
+            int w = put_chunk(s, &outs[j], raw, raw_len, zero, raw_off);
+            bytes_written += w;
+            s->streams[j+1].written += w;
+            sync_chunk(s, &outs[j], raw_off, w);
+        }
+    }
+
+    free_worker_outputs(s, outs);
+    free(frame);
+    free(raw);
+    return NULL;
+}
+
+// Decompresses a compressed file with every -jobs worker at once, each taking whichever frame is next
+// and writing it straight to its place in the outputs, as found from the index at the end of the file.
+// Returns -1 if the index is missing or damaged, in which case the stream can still be read in order
+int copy_frames(Settings *s)
+{
+    Stream *in = &s->streams[0];
+    if (in->direct) {
+        fcntl(in->fd, F_SETFL, fcntl(in->fd, F_GETFL) & ~O_DIRECT);
+        in->direct = false;
+    }
+
+    uint8_t trailer[TRAILER_SIZE], header[FRAME_HEADER];
+    if (in->size < 8 + FRAME_HEADER + TRAILER_SIZE || !pread_exact(in->fd, trailer, TRAILER_SIZE, in->size - TRAILER_SIZE)
+        || memcmp(trailer, INDEX_MAGIC, 8))
+        return -1;
+
+    int64_t index_pos = (int64_t)get_le64(&trailer[8]);
+    if (index_pos < 8 || index_pos > in->size - FRAME_HEADER - TRAILER_SIZE || !pread_exact(in->fd, header, FRAME_HEADER, index_pos))
+        return -1;
+
+    int n = (int)get_le32(header);
+    if (get_le32(&header[8]) != CODEC_INDEX || n % INDEX_ENTRY != 0 || index_pos + FRAME_HEADER + n + TRAILER_SIZE != in->size)
+        return -1;
+
+    uint8_t *index = malloc(n > 0 ? n : 1);
+    if (!pread_exact(in->fd, index, n, index_pos + FRAME_HEADER) || frame_crc(index, n) != get_le32(&header[12])) {
+        free(index);
+        return -1;
+    }
+    int64_t n_frames = n / INDEX_ENTRY;
+
+    // As with -jobs for plain copies, file outputs get their final size first, which the last frame's header gives
+    int64_t total_size = 0;
+    if (n_frames > 0 && pread_exact(in->fd, header, FRAME_HEADER, (int64_t)get_le64(&index[(n_frames - 1) * INDEX_ENTRY])))
+        total_size = (int64_t)get_le64(&index[(n_frames - 1) * INDEX_ENTRY + 8]) + get_le32(&header[4]);
+    for (int i = 1; i < s->n_streams; i++) {
+        Stream *st = &s->streams[i];
+        if (st->type == TYPE_REG && st->size < total_size && ftruncate(st->fd, total_size) == 0)
+            st->size = total_size;
+    }
+
+    if (s->sparse) {
+        s->zeros = alloc_chunk(s, MAX_CHUNK);
+        memset(s->zeros, 0, MAX_CHUNK);
+    }
+
+    _Atomic int64_t next = 0;
+    FrameWorker *workers = calloc(s->jobs, sizeof(FrameWorker));
+    pthread_t *tids = calloc(s->jobs, sizeof(pthread_t));
+    for (int i = 0; i < s->jobs; i++) {
+        workers[i] = (FrameWorker){s, index, n_frames, index_pos, &next};
+        pthread_create(&tids[i], NULL, copy_frame_worker, &workers[i]);
+    }
+    for (int i = 0; i < s->jobs; i++)
+        pthread_join(tids[i], NULL);
+
+    free(s->zeros);
+    s->zeros = NULL;
+    free(workers);
+    free(tids);
+    free(index);
+    return 0;
+}
+
+// -rescue keeps a map of the input in the same spirit as ddrescue's: a list of extents, each of which is
+// untried (?), unreadable so far and due to be retried (*), given up on (-), or copied (+)
+#define MAP_UNTRIED   '?'
+#define MAP_RETRY     '*'
+#define MAP_BAD       '-'
+#define MAP_COPIED    '+'
+
+#define RESCUE_MIN_SKIP       (64 * 1024)
+#define RESCUE_MAX_SKIP       (1024LL * 1024 * 1024)
+#define RESCUE_SAVE_INTERVAL  1000000000LL
+
+typedef struct {
+    int64_t pos;
+    int64_t len;
+    char status;
+} Extent;
+
+typedef struct {
+    Extent *extents;
+    int n_extents;
+    int64_t size;
+    struct timespec last_save;
+} RescueMap;
+
+// Marks [pos, pos + len) with status, splitting the extents it cuts through and merging neighbours with the same status
+static void map_set(RescueMap *m, int64_t pos, int64_t len, char status)
+{
+    if (len <= 0)
+        return;
+
+    Extent *out = malloc((m->n_extents + 2) * sizeof(Extent));
+    int n = 0;
+    bool placed = false;
+    for (int i = 0; i <= m->n_extents; i++) {
+        Extent parts[3];
+        int n_parts = 0;
+        if (i < m->n_extents) {
+            Extent *e = &m->extents[i];
+            int64_t end = e->pos + e->len;
+            if (e->pos < pos)
+                parts[n_parts++] = (Extent){e->pos, (end < pos ? end : pos) - e->pos, e->status};
+            if (!placed && end > pos) {
+                parts[n_parts++] = (Extent){pos, len, status};
+                placed = true;
+            }
+            if (end > pos + len) {
+                int64_t from = e->pos > pos + len ? e->pos : pos + len;
+                parts[n_parts++] = (Extent){from, end - from, e->status};
+            }
+        }
+        else if (!placed) {
+            parts[n_parts++] = (Extent){pos, len, status};
+        }
+
+        for (int j = 0; j < n_parts; j++) {
+            if (n > 0 && out[n-1].status == parts[j].status && out[n-1].pos + out[n-1].len == parts[j].pos)
+                out[n-1].len += parts[j].len;
+            else
+                out[n++] = parts[j];
+        }
+    }
+
+    free(m->extents);
+    m->extents = out;
+    m->n_extents = n;
+}
+
+// Finds the first extent with the given status which ends after pos, clipped so that it starts no earlier than pos
+static bool map_next(RescueMap *m, int64_t pos, char status, int64_t *start, int64_t *end)
+{
+    for (int i = 0; i < m->n_extents; i++) {
+        Extent *e = &m->extents[i];
+        if (e->status == status && e->pos + e->len > pos) {
+            *start = e->pos > pos ? e->pos : pos;
+            *end = e->pos + e->len;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int64_t map_count(RescueMap *m, char status)
+{
+    int64_t n = 0;
+    for (int i = 0; i < m->n_extents; i++) {
+        if (m->extents[i].status == status)
+            n += m->extents[i].len;
+    }
+    return n;
+}
+
+// Returns false if there is a map for a different size of input
+static bool map_load(Settings *s, RescueMap *m)
+{
+    m->size = s->streams[0].size;
+    m->extents = calloc(1, sizeof(Extent));
+    m->extents[0] = (Extent){0, m->size, MAP_UNTRIED};
+    m->n_extents = 1;
+
+    FILE *f = fopen(s->rescue, "r");
+    if (!f)
+        return true;
+
+    char line[256];
+    int64_t size = -1;
+    while (fgets(line, sizeof(line), f)) {
+        int64_t pos, len;
+        char status;
+        if (line[0] == '#')
+            sscanf(line, "# size %li", &size);
+        else if (sscanf(line, "%li %li %c", &pos, &len, &status) == 3)
+            map_set(m, pos, len, status);
+    }
+    fclose(f);
+    return size == m->size;
+}
+
+// Syncs the outputs before saving, so that anything marked as copied really is on disk.
+// The map is replaced in one go, so an interruption leaves either the old map or the new one
+static void map_save(Settings *s, RescueMap *m)
+{
+    for (int i = 1; i < s->n_streams; i++)
+        fdatasync(s->streams[i].fd);
+
+    size_t path_len = strlen(s->rescue) + 8;
+    char *tmp_path = malloc(path_len);
+    snprintf(tmp_path, path_len, "%s.tmp", s->rescue);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (out) {
+        fprintf(out, "# chunker rescue map: offset, length, status (? untried, * to retry, - unreadable, + copied)\n");
+        fprintf(out, "# size 0x%lx\n", m->size);
+        for (int i = 0; i < m->n_extents; i++)
+            fprintf(out, "0x%010lx  0x%010lx  %c\n", m->extents[i].pos, m->extents[i].len, m->extents[i].status);
+        fflush(out);
+        fdatasync(fileno(out));
+        fclose(out);
+        rename(tmp_path, s->rescue);
+    }
+    free(tmp_path);
+
+    bytes_unreadable = map_count(m, MAP_RETRY) + map_count(m, MAP_BAD);
+    clock_gettime(CLOCK_MONOTONIC, &m->last_save);
+}
+
+static bool map_save_due(RescueMap *m)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_nsec - m->last_save.tv_nsec + 1000000000LL * (now.tv_sec - m->last_save.tv_sec) >= RESCUE_SAVE_INTERVAL;
+}
+
+static void map_save_if_due(Settings *s, RescueMap *m)
+{
+    if (map_save_due(m))
+        map_save(s, m);
+}
+
+// Reads up to len bytes at pos, returning how many were read before the first error, or -1 if nothing could be read.
+// As with read_stream, O_DIRECT reads are rounded up to whole sectors, and anything O_DIRECT won't take goes through the page cache
+static int rescue_read(Settings *s, Stream *in, char *buf, int len, int64_t pos)
+{
+    int64_t t = timer_start();
+    int got = 0;
+    ssize_t res = 0;
+    while (got < len) {
+        int want = in->direct ? (int)round_up(len - got, s->align) : len - got;
+        res = pread(in->fd, &buf[got], want, pos + got);
+        if (res < 0 && errno == EINVAL && in->direct) {
+            fcntl(in->fd, F_SETFL, fcntl(in->fd, F_GETFL) & ~O_DIRECT);
+            in->direct = false;
+            continue;
+        }
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        got += (int)res;
+    }
+    got = got < len ? got : len;
+    timer_stop(in, OP_READ, t, got);
+    return got > 0 || res >= 0 ? got : -1;
+}
+
+static void rescue_write(Settings *s, char *buf, int len, int64_t pos)
+{
+    bool zero = s->sparse && is_zero(buf, len);
+    for (int i = 1; i < s->n_streams; i++) {
+        int w = put_chunk(s, &s->streams[i], buf, len, zero, pos);
+        bytes_written += w;
+        s->streams[i].written += w;
+    }
+    bytes_read += len;
+}
+
+// Goes through the given extents block by block, marking each block as copied or as ok_fail.
+// Runs of blocks that end the same way are only put in the map once they end, so the map stays small and cheap to update.
+// In the first pass, each error skips further ahead than the last, so a bad patch costs a few reads instead of thousands
+static void rescue_pass(Settings *s, RescueMap *m, char status, int block, char fail_status, bool skip)
+{
+    Stream *in = &s->streams[0];
+    char *buf = alloc_chunk(s, block);
+    int64_t skip_len = RESCUE_MIN_SKIP;
+
+    int64_t start, end, pos = 0;
+    while (map_next(m, pos, status, &start, &end)) {
+        int64_t good = start;
+        pos = start;
+        while (pos < end) {
+            int len = end - pos < block ? (int)(end - pos) : block;
+            // A short read is followed by a read of the rest, which then either fails properly or finds the end of the input
+            int got = rescue_read(s, in, buf, len, pos);
+            if (got > 0) {
+                rescue_write(s, buf, got, pos);
+                pos += got;
+                skip_len = RESCUE_MIN_SKIP;
+                // A long clean run is put in the map as it goes too, or an interrupted rescue would have to start over
+                if (map_save_due(m)) {
+                    map_set(m, good, pos - good, MAP_COPIED);
+                    good = pos;
+                    map_save(s, m);
+                }
+                continue;
+            }
+            if (got == 0)
+                break;
+
+            map_set(m, good, pos - good, MAP_COPIED);
+            int64_t bad_end = pos + len;
+            if (skip) {
+                bad_end += skip_len;
+                skip_len = skip_len * 2 < RESCUE_MAX_SKIP ? skip_len * 2 : RESCUE_MAX_SKIP;
+            }
+            bad_end = bad_end < end ? bad_end : end;
+            map_set(m, pos, bad_end - pos, fail_status);
+            pos = good = bad_end;
+            map_save_if_due(s, m);
+        }
+        map_set(m, good, pos - good, MAP_COPIED);
+
+        // The input came back shorter than it was, so whatever is left can't be read
+        if (pos < end) {
+            map_set(m, pos, end - pos, MAP_BAD);
+            pos = end;
+        }
+        map_save_if_due(s, m);
+    }
+
+    free(buf);
+}
+
+// Copies as much of a failing input as possible, as quickly as possible: first everything that reads cleanly,
+// skipping over bad patches, then the skipped and failed parts again with smaller and smaller blocks,
+// down to a single sector. What still fails is given up on. The map lets an interrupted rescue carry on where it left off
+bool rescue_map_valid(Settings *s)
+{
+    RescueMap m = {0};
+    bool valid = map_load(s, &m);
+    free(m.extents);
+    return valid;
+}
+
+void copy_rescue(Settings *s)
+{
+    RescueMap m = {0};
+    map_load(s, &m);
+    clock_gettime(CLOCK_MONOTONIC, &m.last_save);
+    bytes_unreadable = map_count(&m, MAP_RETRY) + map_count(&m, MAP_BAD);
+
+    // Reading ahead would only run into the bad patches sooner
+    Stream *in = &s->streams[0];
+    posix_fadvise(in->fd, 0, 0, POSIX_FADV_RANDOM);
+    for (int i = 1; i < s->n_streams; i++) {
+        Stream *st = &s->streams[i];
+        if (st->type == TYPE_REG && st->size < m.size && ftruncate(st->fd, m.size) == 0)
+            st->size = m.size;
+    }
+    if (s->sparse) {
+        s->zeros = alloc_chunk(s, MAX_CHUNK);
+        memset(s->zeros, 0, MAX_CHUNK);
+    }
+
+    int block = fit_chunk_size(s, s->chunksize > 0 ? s->chunksize : 1024 * 1024);
+    int sector = in->lbs > 512 ? in->lbs : 512;
+    rescue_pass(s, &m, MAP_UNTRIED, block, MAP_RETRY, true);
+    while (block > sector) {
+        block = block / 8 > sector ? (int)round_up(block / 8, sector) : sector;
+        rescue_pass(s, &m, MAP_RETRY, block, block > sector ? MAP_RETRY : MAP_BAD, false);
+    }
+
+    map_save(s, &m);
+    free(m.extents);
+    free(s->zeros);
+    s->zeros = NULL;
+}
+
+void *copy_data(void *args)
+{
+    Settings *s = (Settings*)args;
+
+    int res = -1;
+    if (s->rescue) {
+        copy_rescue(s);
+        copy_method = "rescue";
+        res = 0;
+    }
+    else if (s->jobs > 1 && s->decompress) {
+        res = copy_frames(s);
+        copy_method = "jobs";
+    }
+    else if (s->jobs > 1) {
+        copy_ranges(s);
+        copy_method = "jobs";
+        res = 0;
+    }
+    else if (!s->nozerocopy) {
+        res = copy_zerocopy(s);
+        copy_method = "zerocopy";
+    }
+    else if (s->engine == ENGINE_URING) {
+        res = copy_uring(s);
+        copy_method = engine_strings[ENGINE_URING];
+    }
+
+    if (res < 0) {
+        if (s->engine == ENGINE_PIPE)
+            copy_pipeline(s);
+        else
+            copy_sync(s);
+        copy_method = engine_strings[s->engine == ENGINE_PIPE ? ENGINE_PIPE : ENGINE_SYNC];
+    }
+
+    for (int i = s->n_streams; i < s->n_streams + s->n_inputs - 1; i++)
+        close(s->streams[i].fd);
+
+    for (int i = 0; i < s->n_streams; i++) {
+        if (!s->nosync && i > 0 && s->streams[i].fd != -1) {
+            int64_t t = timer_start();
+            fsync(s->streams[i].fd);
+            timer_stop(&s->streams[i], OP_SYNC, t, 0);
+        }
+        if (s->streams[i].fd > 2)
+            close(s->streams[i].fd);
+        free(s->streams[i].scratch);
+        s->streams[i].scratch = NULL;
+        free_writeback(&s->streams[i]);
+    }
+
+    if (s->hash && s->hash->verify)
+        verify_outputs(s);
+
+    cancelled = 1;
+    if (s->finished_fd > 0) {
+        char c = 1;
+        write(s->finished_fd, &c, 1);
+    }
+
+    return NULL;
+}
+
+// -bench times chunker against dd over a sweep of settings, and prints the results as CSV.
+// Every configuration copies the same file of incompressible data, made in the given directory (ideally a tmpfs,
+// so that the numbers measure chunker rather than the disk). With -loop, the same sweep is run again with the
+// source and outputs attached to loop devices, which takes the block device paths instead of the file ones
+#define BENCH_DEFAULT_SIZE  (64 * 1024 * 1024)
+#define BENCH_MAX_OUTPUTS   2
+
+static const int bench_chunk_sizes[] = {64 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024};
+#define N_BENCH_CHUNK_SIZES (int)(sizeof(bench_chunk_sizes) / sizeof(bench_chunk_sizes[0]))
+
+// How often each copy is made durable: never, after every chunk, or with a window of writeback in flight.
+// dd has no equivalent of -syncwindow, so its baseline for that one is a single fdatasync at the end
+static const char * const bench_sync_strings[] = {"none", "chunk", "window"};
+#define N_BENCH_SYNCS (int)(sizeof(bench_sync_strings) / sizeof(bench_sync_strings[0]))
+
+static const char * const bench_engine_strings[] = {"sync", "pipeline", "zerocopy"};
+#define N_BENCH_ENGINES (int)(sizeof(bench_engine_strings) / sizeof(bench_engine_strings[0]))
+
+typedef struct {
+    const char *target;
+    char *src;
+    char *outs[BENCH_MAX_OUTPUTS];
+} BenchTarget;
+
+static bool bench_make_file(const char *path, int64_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    // xorshift output, so that nothing along the way can shortcut the copy by compressing or deduplicating it
+    char *buf = malloc(MAX_CHUNK);
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    bool ok = true;
+    for (int64_t done = 0; ok && done < size; ) {
+        int len = size - done < MAX_CHUNK ? (int)(size - done) : MAX_CHUNK;
+        for (int i = 0; i < len; i += 8) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            memcpy(&buf[i], &x, len - i < 8 ? len - i : 8);
+        }
+        ok = write_all(fd, buf, len);
+        done += len;
+    }
+    free(buf);
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Attaches path to a free loop device, returning the device's path, or NULL if loop devices aren't available here
+static char *bench_attach_loop(const char *path)
+{
+    int ctl = open("/dev/loop-control", O_RDWR);
+    if (ctl < 0)
+        return NULL;
+    int n = ioctl(ctl, LOOP_CTL_GET_FREE);
+    close(ctl);
+    if (n < 0)
+        return NULL;
+
+    char *dev = malloc(32);
+    snprintf(dev, 32, "/dev/loop%d", n);
+    int fd = open(path, O_RDWR);
+    int loop_fd = open(dev, O_RDWR);
+    bool ok = fd >= 0 && loop_fd >= 0 && ioctl(loop_fd, LOOP_SET_FD, fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (loop_fd >= 0)
+        close(loop_fd);
+    if (!ok) {
+        free(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+static void bench_detach_loop(const char *dev)
+{
+    int fd = open(dev, O_RDWR);
+    if (fd >= 0) {
+        ioctl(fd, LOOP_CLR_FD, 0);
+        close(fd);
+    }
+}
+
+// Runs a command with its output discarded, returning how long it took in seconds, or -1 if it failed
+static double bench_run(char **args)
+{
+    int64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execvp(args[0], args);
+        _exit(127);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return -1.0;
+    double secs = (double)(now_ns() - start) / 1e9;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? secs : -1.0;
+}
+
+static bool bench_same(const char *a, const char *b, int64_t size)
+{
+    int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+    char *ba = malloc(MAX_CHUNK), *bb = malloc(MAX_CHUNK);
+    bool same = fa >= 0 && fb >= 0;
+    for (int64_t off = 0; same && off < size; off += MAX_CHUNK) {
+        int len = size - off < MAX_CHUNK ? (int)(size - off) : MAX_CHUNK;
+        same = pread_exact(fa, ba, len, off) && pread_exact(fb, bb, len, off) && !memcmp(ba, bb, len);
+    }
+    if (fa >= 0)
+        close(fa);
+    if (fb >= 0)
+        close(fb);
+    free(ba);
+    free(bb);
+    return same;
+}
+
+// Takes the source and outputs out of the page cache between runs, so that every run starts cold where it can
+static void bench_drop_cache(BenchTarget *t)
+{
+    for (int i = 0; i <= BENCH_MAX_OUTPUTS; i++) {
+        const char *path = i == 0 ? t->src : t->outs[i-1];
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (!strncmp(path, "/dev/", 5))
+            ioctl(fd, BLKFLSBUF, 0);
+        close(fd);
+    }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times one configuration runs times, and prints its row. Each command is run once per output when the tool
+// only takes one output (dd), and the times are added together
+static void bench_config(BenchTarget *t, int64_t size, int runs, const char *tool, const char *engine,
+                         int chunk_size, int sync, int n_outputs, char **args, int out_arg)
+{
+    double *times = calloc(runs, sizeof(double));
+    bool failed = false, mismatch = false;
+    for (int r = 0; r < runs && !failed; r++) {
+        bench_drop_cache(t);
+        for (int o = 0; o < (out_arg >= 0 ? n_outputs : 1) && !failed; o++) {
+            if (out_arg >= 0) {
+                char *dst = t->outs[o];
+                char *of = malloc(strlen(dst) + 4);
+                sprintf(of, "of=%s", dst);
+                args[out_arg] = of;
+                double secs = bench_run(args);
+                free(of);
+                failed = secs < 0.0;
+                times[r] += secs;
+            }
+            else {
+                double secs = bench_run(args);
+                failed = secs < 0.0;
+                times[r] = secs;
+            }
+        }
+        for (int o = 0; r == 0 && !failed && o < n_outputs; o++)
+            mismatch |= !bench_same(t->src, t->outs[o], size);
+    }
+
+    qsort(times, runs, sizeof(double), compare_doubles);
+    double median = times[runs / 2];
+    printf("%s,%s,%s,%d,%s,%d,%ld,%d,", tool, t->target, engine, chunk_size, bench_sync_strings[sync], n_outputs, size, runs);
+    if (failed)
+        printf(",,,failed\n");
+    else
+        printf("%.4f,%.4f,%.1f,%s\n", median, times[0], median > 0.0 ? (double)size * n_outputs / median / 1e6 : 0.0, mismatch ? "mismatch" : "ok");
+    fflush(stdout);
+    free(times);
+}
+
+static void bench_target(BenchTarget *t, int64_t size, int runs)
+{
+    char chunk_arg[32], size_arg[32], count_arg[32];
+    snprintf(size_arg, sizeof(size_arg), "%ld", size);
+
+    for (int c = 0; c < N_BENCH_CHUNK_SIZES; c++) {
+        int chunk_size = bench_chunk_sizes[c];
+        snprintf(chunk_arg, sizeof(chunk_arg), "%d", chunk_size);
+        snprintf(count_arg, sizeof(count_arg), "count=%ld", (size + chunk_size - 1) / chunk_size);
+        char bs_arg[32];
+        snprintf(bs_arg, sizeof(bs_arg), "bs=%d", chunk_size);
+        char *if_arg = malloc(strlen(t->src) + 4);
+        sprintf(if_arg, "if=%s", t->src);
+
+        for (int sync = 0; sync < N_BENCH_SYNCS; sync++) {
+            for (int n_outputs = 1; n_outputs <= BENCH_MAX_OUTPUTS; n_outputs++) {
+                char *args[32];
+                int n = 0;
+                args[n++] = "dd";
+                args[n++] = if_arg;
+                int out_arg = n++;
+                args[n++] = bs_arg;
+                args[n++] = count_arg;
+                args[n++] = "conv=notrunc";
+                args[n++] = "status=none";
+                if (sync == 1)
+                    args[n++] = "oflag=dsync";
+                else if (sync == 2)
+                    args[n++] = "conv=fdatasync";
+                args[n] = NULL;
+                bench_config(t, size, runs, "dd", "", chunk_size, sync, n_outputs, args, out_arg);
+
+                for (int e = 0; e < N_BENCH_ENGINES; e++) {
+                    n = 0;
+                    args[n++] = "/proc/self/exe";
+                    args[n++] = "-i";
+                    args[n++] = t->src;
+                    for (int o = 0; o < n_outputs; o++) {
+                        args[n++] = "-o";
+                        args[n++] = t->outs[o];
+                    }
+                    args[n++] = "-noconfirm";
+                    args[n++] = "-noprogress";
+                    args[n++] = "-noautochunk";
+                    args[n++] = "-chunksize";
+                    args[n++] = chunk_arg;
+                    args[n++] = "-totalsize";
+                    args[n++] = size_arg;
+                    if (e < 2) {
+                        args[n++] = "-engine";
+                        args[n++] = (char*)engine_strings[e == 0 ? ENGINE_SYNC : ENGINE_PIPE];
+                    }
+                    if (sync == 0) {
+                        args[n++] = "-nosync";
+                    }
+                    else if (sync == 2) {
+                        args[n++] = "-syncwindow";
+                        args[n++] = "8";
+                    }
+                    args[n] = NULL;
+                    bench_config(t, size, runs, "chunker", bench_engine_strings[e], chunk_size, sync, n_outputs, args, -1);
+                }
+            }
+        }
+        free(if_arg);
+    }
+}
+
+int run_bench(int argc, char **argv)
+{
+    char *dir = get_string_element(argv, argc, 2);
+    int64_t size = BENCH_DEFAULT_SIZE;
+    int runs = 3;
+    bool loop = false;
+    for (int i = 3; i < argc; i++) {
+        bool invalid = false;
+        if (!strcmp(argv[i], "-totalsize")) {
+            size = get_size_element(argv, argc, ++i);
+            invalid = size <= 0;
+        }
+        else if (!strcmp(argv[i], "-runs")) {
+            runs = (int)get_int64_element_or(argv, argc, ++i, -1);
+            invalid = runs <= 0;
+        }
+        else if (!strcmp(argv[i], "-loop")) {
+            loop = true;
+        }
+        else {
+            invalid = true;
+        }
+        if (invalid) {
+            print_help(stderr);
+            return 1;
+        }
+    }
+    if (!dir) {
+        print_help(stderr);
+        return 1;
+    }
+
+    // The outputs are made up front at full size, so that every tool overwrites them in place rather than growing them
+    BenchTarget files = {.target = "file"};
+    int path_len = (int)strlen(dir) + 32;
+    files.src = malloc(path_len);
+    snprintf(files.src, path_len, "%s/chunker-bench-src", dir);
+    bool ok = bench_make_file(files.src, size);
+    for (int i = 0; i < BENCH_MAX_OUTPUTS; i++) {
+        files.outs[i] = malloc(path_len);
+        snprintf(files.outs[i], path_len, "%s/chunker-bench-out%d", dir, i);
+        int fd = open(files.outs[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        ok = ok && fd >= 0 && ftruncate(fd, size) == 0;
+        if (fd >= 0)
+            close(fd);
+    }
+    if (!ok) {
+        fprintf(stderr, "Could not create the benchmark files in %s\n", dir);
+        return 2;
+    }
+
+    BenchTarget loops = {.target = "loop"};
+    if (loop) {
+        loops.src = bench_attach_loop(files.src);
+        for (int i = 0; i < BENCH_MAX_OUTPUTS; i++)
+            loops.outs[i] = loops.src ? bench_attach_loop(files.outs[i]) : NULL;
+        if (!loops.src || !loops.outs[BENCH_MAX_OUTPUTS-1]) {
+            fprintf(stderr, "Could not attach loop devices, only benchmarking files\n");
+            loop = false;
+        }
+    }
+
+    printf("tool,target,engine,chunk_size,sync,outputs,bytes,runs,median_seconds,min_seconds,mb_per_second,result\n");
+    bench_target(&files, size, runs);
+    if (loop)
+        bench_target(&loops, size, runs);
+
+    for (int i = 0; i <= BENCH_MAX_OUTPUTS; i++) {
+        char *dev = i == 0 ? loops.src : loops.outs[i-1];
+        if (dev) {
+            bench_detach_loop(dev);
+            free(dev);
+        }
+        char *path = i == 0 ? files.src : files.outs[i-1];
+        unlink(path);
+        free(path);
+    }
+    return 0;
 }
@@ -5,18 +5,53 @@
    and viewing parts of files with hex+ASCII.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && defined(__AVX2__)
+	#include <immintrin.h>
+	#define SEARCH_AVX2
+#elif defined(__GNUC__) && defined(__SSE2__)
+	#include <emmintrin.h>
+	#define SEARCH_SSE2
+#endif
 
 typedef unsigned char u8;
 
+// Edits to a file are kept in a piece table instead of being made to its data directly.
+// The file's original contents stay as they were, new bytes are appended to a separate add buffer,
+// and the file is the in-order list of pieces taken from either one.
+// The pieces are kept in a treap ordered by their position in the file, so that any edit is
+// a couple of O(log n) splits and joins, and the file is only put back together when it's saved
+typedef struct piece {
+	struct piece *left, *right;
+	int from_add;
+	int64_t start, len;
+	int64_t total; // length of this piece plus everything under it
+	unsigned prio;
+} piece;
+
 // this struct is used for three unique purposes:
 // files, arrays, and "filler" (empty) content
 typedef struct {
 	char *name;
 	u8 *data;
-	int size;
+	int64_t size;
+	int64_t cap;
+	int loaded; // data holds the file as it is on disk
+	int mapped; // data is the file mapped into memory, so it's read-only
+	piece *pieces; // NULL until the buffer is first edited
+	u8 *add;
+	int64_t add_size, add_cap;
 } buffer;
 
 void strip(char *str) {
@@ -28,60 +63,363 @@ void strip(char *str) {
 
 int is_empty(buffer *buf) {
 	if (!buf) return 1;
-	if (!buf->data || buf->size < 1) return 2;
+	if ((!buf->data && !buf->pieces) || buf->size < 1) return 2;
 	return 0;
 }
 
+int64_t piece_total(piece *p) {
+	return p ? p->total : 0;
+}
+
+void update_piece(piece *p) {
+	p->total = piece_total(p->left) + p->len + piece_total(p->right);
+}
+
+piece *new_piece(int from_add, int64_t start, int64_t len) {
+	static unsigned seed = 2463534242u;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	piece *p = calloc(1, sizeof(piece));
+	p->from_add = from_add;
+	p->start = start;
+	p->len = len;
+	p->total = len;
+	p->prio = seed;
+	return p;
+}
+
+void free_pieces(piece *p) {
+	if (!p) return;
+	free_pieces(p->left);
+	free_pieces(p->right);
+	free(p);
+}
+
+piece *join_pieces(piece *a, piece *b) {
+	if (!a) return b;
+	if (!b) return a;
+
+	if (a->prio > b->prio) {
+		a->right = join_pieces(a->right, b);
+		update_piece(a);
+		return a;
+	}
+	b->left = join_pieces(a, b->left);
+	update_piece(b);
+	return b;
+}
+
+// Splits p into the pieces before pos and the pieces from pos onwards, cutting a piece in two if pos lands inside it
+void split_pieces(piece *p, int64_t pos, piece **before, piece **after) {
+	if (!p) {
+		*before = *after = NULL;
+		return;
+	}
+
+	int64_t left_len = piece_total(p->left);
+	if (pos <= left_len) {
+		split_pieces(p->left, pos, before, &p->left);
+		update_piece(p);
+		*after = p;
+	}
+	else if (pos >= left_len + p->len) {
+		split_pieces(p->right, pos - left_len - p->len, &p->right, after);
+		update_piece(p);
+		*before = p;
+	}
+	else {
+		int64_t cut = pos - left_len;
+		piece *tail = new_piece(p->from_add, p->start + cut, p->len - cut);
+		*after = join_pieces(tail, p->right);
+		p->right = NULL;
+		p->len = cut;
+		update_piece(p);
+		*before = p;
+	}
+}
+
+u8 *piece_data(buffer *buf, piece *p) {
+	return (p->from_add ? buf->add : buf->data) + p->start;
+}
+
+// Until a buffer is edited, all of it is in data, which is the same as a single piece covering the whole thing
+void init_pieces(buffer *buf) {
+	if (!buf->pieces && buf->size > 0)
+		buf->pieces = new_piece(0, 0, buf->size);
+}
+
+// Whether data holds the buffer's contents as they are now, in which case it can be used directly
+int is_flat(buffer *buf) {
+	piece *p = buf->pieces;
+	return !p || (!p->left && !p->right && !p->from_add && p->start == 0 && p->len == buf->size);
+}
+
+// Copies len bytes from off in the buffer to out, following the pieces. Returns the end of what was copied
+u8 *read_pieces(buffer *buf, piece *p, int64_t off, int64_t len, u8 *out) {
+	if (!p || len <= 0) return out;
+
+	int64_t left_len = piece_total(p->left);
+	if (off < left_len) {
+		out = read_pieces(buf, p->left, off, len, out);
+		len -= left_len - off;
+		off = left_len;
+	}
+	if (len > 0 && off < left_len + p->len) {
+		int64_t from = off - left_len;
+		int64_t n = p->len - from < len ? p->len - from : len;
+		memcpy(out, piece_data(buf, p) + from, n);
+		out += n;
+		len -= n;
+		off += n;
+	}
+	if (len > 0)
+		out = read_pieces(buf, p->right, off - left_len - p->len, len, out);
+	return out;
+}
+
+void read_buffer(buffer *buf, int64_t off, int64_t len, u8 *out) {
+	if (is_flat(buf)) memcpy(out, buf->data + off, len);
+	else read_pieces(buf, buf->pieces, off, len, out);
+}
+
+void free_data(buffer *buf) {
+	if (buf->mapped) munmap(buf->data, buf->cap);
+	else free(buf->data);
+	buf->data = NULL;
+	buf->mapped = 0;
+	buf->loaded = 0;
+}
+
+// Puts the buffer's contents back into data, for the operations that need all of it in one place
+void flatten_buffer(buffer *buf) {
+	if (!buf || is_flat(buf)) return;
+
+	u8 *data = malloc(buf->size > 0 ? buf->size : 1);
+	read_pieces(buf, buf->pieces, 0, buf->size, data);
+	free_data(buf);
+	free(buf->add);
+	free_pieces(buf->pieces);
+	buf->data = data;
+	buf->cap = buf->size;
+	buf->pieces = NULL;
+	buf->add = NULL;
+	buf->add_size = buf->add_cap = 0;
+}
+
+// Appends bytes to the add buffer, returning where they went
+int64_t append_add(buffer *buf, u8 *data, int64_t len) {
+	if (buf->add_size + len > buf->add_cap) {
+		buf->add_cap = buf->add_cap * 2 > buf->add_size + len ? buf->add_cap * 2 : buf->add_size + len;
+		buf->add = realloc(buf->add, buf->add_cap);
+	}
+	memcpy(buf->add + buf->add_size, data, len);
+	buf->add_size += len;
+	return buf->add_size - len;
+}
+
+// Replaces len bytes at off with the bytes in the add buffer from start onwards, of which there are add_len
+void replace_pieces(buffer *buf, int64_t off, int64_t len, int64_t start, int64_t add_len) {
+	init_pieces(buf);
+
+	piece *before, *middle, *after;
+	split_pieces(buf->pieces, off, &before, &after);
+	split_pieces(after, len, &middle, &after);
+	free_pieces(middle);
+
+	if (add_len > 0)
+		before = join_pieces(before, new_piece(1, start, add_len));
+	buf->pieces = join_pieces(before, after);
+	buf->size = piece_total(buf->pieces);
+}
+
+int write_pieces(buffer *buf, piece *p, FILE *f) {
+	if (!p) return 0;
+	if (write_pieces(buf, p->left, f) < 0) return -1;
+	if (fwrite(piece_data(buf, p), 1, p->len, f) != (size_t)p->len) return -1;
+	return write_pieces(buf, p->right, f);
+}
+
+int write_buffer(buffer *buf, FILE *f) {
+	if (!is_flat(buf)) return write_pieces(buf, buf->pieces, f);
+	if (buf->data && buf->size > 0 && fwrite(buf->data, 1, buf->size, f) != (size_t)buf->size) return -1;
+	return 0;
+}
+
+// Whether every piece of the original file is still at the offset it came from, with pos being where p starts
+int pieces_in_place(piece *p, int64_t pos) {
+	if (!p) return 1;
+	int64_t at = pos + piece_total(p->left);
+	return (p->from_add || p->start == at) &&
+		pieces_in_place(p->left, pos) && pieces_in_place(p->right, at + p->len);
+}
+
+// Writes every piece that isn't already in the file, which with pieces_in_place() means only what was edited
+int write_dirty(buffer *buf, piece *p, int64_t pos, int fd) {
+	if (!p) return 0;
+	int64_t at = pos + piece_total(p->left);
+	if (write_dirty(buf, p->left, pos, fd) < 0) return -1;
+
+	u8 *data = piece_data(buf, p);
+	int64_t done = 0;
+	while (p->from_add && done < p->len) {
+		ssize_t n = pwrite(fd, data + done, p->len - done, at + done);
+		if (n <= 0) return -1;
+		done += n;
+	}
+	return write_dirty(buf, p->right, at + p->len, fd);
+}
+
 void close_buffer(buffer *buf) {
 	if (!buf) return;
 	if (buf->name) free(buf->name);
-	if (buf->data) free(buf->data);
+	if (buf->data) free_data(buf);
+	free(buf->add);
+	free_pieces(buf->pieces);
 	memset(buf, 0, sizeof(buffer));
 }
 
 int load_file(buffer *buf, char *name) {
 	if (!buf || !name) return -1;
-	if (buf->data) free(buf->data);
-	memset(buf, 0, sizeof(buffer));
+	close_buffer(buf);
 
-	FILE *f = fopen(name, "rb");
-	if (!f) return -2;
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) return -2;
 	buf->name = strdup(name);
+	buf->loaded = 1;
 
-	fseek(f, 0, SEEK_END);
-	int sz = ftell(f);
-	if (sz < 1) return 0; // All good but nothing else to do
-	rewind(f);
+	// Seeking to the end also gives the size of a block device, which stat doesn't
+	int64_t sz = lseek(fd, 0, SEEK_END);
+	if (sz < 1) { // All good but nothing else to do
+		close(fd);
+		return 0;
+	}
 
+	// Mapping the file means that only the parts that get looked at are ever read,
+	// so changing a few bytes of a huge file doesn't mean reading all of it first
 	buf->size = sz;
-	buf->data = malloc(buf->size);
-	fread(buf->data, 1, buf->size, f);
+	buf->cap = sz;
+	buf->data = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf->data != MAP_FAILED) {
+		buf->mapped = 1;
+		close(fd);
+		return 0;
+	}
+
+	buf->data = malloc(sz);
+	int64_t got = 0;
+	while (buf->data && got < sz) {
+		ssize_t n = pread(fd, buf->data + got, sz - got, got);
+		if (n <= 0) break;
+		got += n;
+	}
+	close(fd);
+	return got == sz ? 0 : -2;
+}
+
+// Opens a temporary file next to the one being replaced, with the same permissions
+FILE *open_replacement(char *name, char **temp_ref, char **path_ref) {
+	// Replace what a symlink points to, not the link
+	char *path = realpath(name, NULL);
+	struct stat st;
+	if (!path || stat(path, &st) < 0) {
+		free(path);
+		return NULL;
+	}
+
+	char *temp = malloc(strlen(path) + 8);
+	sprintf(temp, "%s.XXXXXX", path);
+	int fd = mkstemp(temp);
+	if (fd < 0) {
+		free(temp);
+		free(path);
+		return NULL;
+	}
+	fchmod(fd, st.st_mode & 07777);
+
+	FILE *f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		unlink(temp);
+		free(temp);
+		free(path);
+		return NULL;
+	}
+	*temp_ref = temp;
+	*path_ref = path;
+	return f;
+}
+
+// Moves the temporary file over the original once it's safely on disk, or deletes it if anything went wrong
+int finish_replacement(FILE *f, int res, char *temp, char *path) {
+	if (fflush(f) != 0 || fsync(fileno(f)) < 0) res = -1;
 	fclose(f);
-	return 0;
+
+	if (res == 0 && rename(temp, path) < 0) res = -1;
+	if (res < 0) unlink(temp);
+	free(temp);
+	free(path);
+	return res;
 }
 
-void save_buffer(buffer *buf) {
-	if (!buf || !buf->name) return;
+// Writes the buffer to a new file next to the old one, then puts it in place of the old one.
+// A mapped file is still being read from while it's saved, so it can't be truncated and rewritten
+int replace_file(buffer *buf) {
+	char *temp, *path;
+	FILE *f = open_replacement(buf->name, &temp, &path);
+	if (!f) return -1;
+	return finish_replacement(f, write_buffer(buf, f), temp, path);
+}
+
+int save_buffer(buffer *buf) {
+	if (!buf || !buf->name) return -1;
+
+	// When nothing from the file has moved, as with -p, -f, -w and -c, or with data added or removed at the end,
+	// only the edited ranges need writing
+	if (buf->loaded && pieces_in_place(buf->pieces, 0)) {
+		int fd = open(buf->name, O_WRONLY);
+		int res = fd < 0 ? -1 : write_dirty(buf, buf->pieces, 0, fd);
+		if (res == 0 && buf->size != buf->cap && ftruncate(fd, buf->size) < 0) res = -1;
+		if (fd >= 0) close(fd);
+		if (res < 0) printf("Could not write to \"%s\"\n", buf->name);
+		return res;
+	}
+
+	// Only regular files can be replaced. Anything else gets rewritten from memory
+	struct stat st;
+	if (buf->mapped && stat(buf->name, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (replace_file(buf) < 0) {
+			printf("Could not write to \"%s\"\n", buf->name);
+			return -1;
+		}
+		return 0;
+	}
+	if (buf->mapped) flatten_buffer(buf);
 
 	FILE *f = fopen(buf->name, "wb");
-	if (!f || !buf->data || buf->size < 1) return;
+	if (!f) {
+		printf("Could not write to \"%s\"\n", buf->name);
+		return -1;
+	}
 
-	fwrite(buf->data, 1, buf->size, f);
-	fclose(f);
+	int res = write_buffer(buf, f);
+	if (fclose(f) != 0) res = -1;
+	if (res < 0) printf("Could not write to \"%s\"\n", buf->name);
+	return res;
 }
 
-void create_filler(buffer *buf, u8 fill, int size) {
+void create_filler(buffer *buf, u8 fill, int64_t size) {
 	if (!buf || size < 1) return;
 
-	if (buf->data) free(buf->data);
-	memset(buf, 0, sizeof(buffer));
+	close_buffer(buf);
 
 	buf->data = calloc(size, 1);
 	buf->size = size;
 	memset(buf->data, fill, buf->size);
 }
 
-void swap_buffer(buffer *buf, int off, int len, int swap) {
+void swap_buffer(buffer *buf, int64_t off, int64_t len, int swap) {
 	if (is_empty(buf) || swap <= 1 || off > buf->size - swap) return;
 
 	if (off < 0) off = 0;
@@ -91,31 +429,43 @@ void swap_buffer(buffer *buf, int off, int len, int swap) {
 	len -= len % swap;
 	if (len <= 0) return;
 
+	// The swapped bytes become a single new piece
+	u8 *swapped = malloc(len);
+	read_buffer(buf, off, len, swapped);
+
 	u8 *temp = malloc(swap);
-	int i, j;
-	for (i = off; i < off+len; i += swap) {
-		memcpy(temp, buf->data + i, swap);
-		for (j = 0; j < swap; j++) buf->data[i+j] = temp[swap-j-1];
+	int64_t i;
+	int j;
+	for (i = 0; i < len; i += swap) {
+		memcpy(temp, swapped + i, swap);
+		for (j = 0; j < swap; j++) swapped[i+j] = temp[swap-j-1];
 	}
 	free(temp);
+
+	replace_pieces(buf, off, len, append_add(buf, swapped, len), len);
+	free(swapped);
 }
 
 void add_byte(buffer *buf, u8 x) {
-	buf->data = realloc(buf->data, ++buf->size);
-	buf->data[buf->size - 1] = x;
+	if (buf->size >= buf->cap) {
+		buf->cap = buf->cap ? buf->cap * 2 : 16;
+		buf->data = realloc(buf->data, buf->cap);
+	}
+	buf->data[buf->size++] = x;
 }
 
-void read_array(buffer *array, char **str, int n_strs) {
+// Reads byte data the same way as read_array, but a '?' in place of a hex digit matches any nibble.
+// For each byte, mask gets 0xff where all of it must match, 0xf0 or 0x0f for half of it, or 0 for "??"
+void read_pattern(buffer *array, buffer *mask, char **str, int n_strs) {
 	if (!array || !str || n_strs < 1) return;
-	if (array->name) free(array->name);
-	if (array->data) free(array->data);
-	memset(array, 0, sizeof(buffer));
+	close_buffer(array);
+	if (mask) close_buffer(mask);
 
-	int i, j, len = 0, mode = 0;
+	int i, j, mode = 0;
 	for (i = 0; i < n_strs; i++) {
 		if (!str[i]) continue;
 
-		int dg_left = 2, digit = 0, byte = 0;
+		int dg_left = 2, digit = 0, byte = 0, bits = 0, known = 0xf;
 		for (j = 0; str[i][j]; j++) {
 			char c = str[i][j];
 			if (c < ' ' || c > '~') continue;
@@ -126,9 +476,14 @@ void read_array(buffer *array, char **str, int n_strs) {
 
 			if (!mode) {
 				int sub = 0;
+				known = 0xf;
 				if (c >= '0' && c <= '9') sub = '0';
 				if (c >= 'A' && c <= 'F') sub = 'A' - 0xa;
 				if (c >= 'a' && c <= 'f') sub = 'a' - 0xa;
+				if (c == '?' && mask) {
+					sub = c;
+					known = 0;
+				}
 				if (!sub) continue;
 
 				digit = c - sub;
@@ -136,55 +491,74 @@ void read_array(buffer *array, char **str, int n_strs) {
 			}
 			else {
 				digit = c;
+				known = 0xff;
 				dg_left = 0;
 			}
 			byte <<= 4;
 			byte |= digit;
+			bits <<= 4;
+			bits |= known;
 
 			if (dg_left <= 0) {
 				add_byte(array, byte);
+				if (mask) add_byte(mask, bits);
 				byte = 0;
+				bits = 0;
 				dg_left = 2;
 			}
 		}
-		if (mode && i < n_strs-1) add_byte(array, ' ');
-		if (!mode && dg_left == 1) add_byte(array, byte);
+		if (mode && i < n_strs-1) {
+			add_byte(array, ' ');
+			if (mask) add_byte(mask, 0xff);
+		}
+		if (!mode && dg_left == 1) {
+			add_byte(array, byte);
+			if (mask) add_byte(mask, bits | 0xf0);
+		}
 	}
 }
 
-void apply_buffer(buffer *dst, buffer *src, int dst_pos, int src_pos, int len, int insert) {
-	if (!dst || !src || (!dst->data && !src->data) ||
-		(dst->size < 1 && src->size < 1) || src_pos >= src->size) return;
+int64_t read_number(char *str) {
+	return memcmp(str, "0x", 2) ? strtoll(str, NULL, 10) : strtoll(str, NULL, 16);
+}
+
+void read_array(buffer *array, char **str, int n_strs) {
+	read_pattern(array, NULL, str, n_strs);
+}
+
+void apply_buffer(buffer *dst, buffer *src, int64_t dst_pos, int64_t src_pos, int64_t len, int insert) {
+	if (!dst || !src || (dst->size < 1 && src->size < 1) || src_pos >= src->size) return;
 
 	if (src_pos < 0) src_pos = 0;
 	if (len < 1) len = src->size - src_pos;
+	if (src_pos + len > src->size) len = src->size - src_pos;
 	if (dst_pos < -len) dst_pos = -len;
 	if (dst_pos > dst->size) dst_pos = dst->size;
 
+	int64_t replaced = 0;
 	if (insert) {
 		if (dst_pos < 0) dst_pos = 0;
-		dst->data = realloc(dst->data, dst->size + len);
-		if (dst_pos < dst->size) {
-			memmove(dst->data + dst_pos + len, dst->data + dst_pos, dst->size - dst_pos);
-		}
-		dst->size += len;
 	}
 	else {
 		if (dst_pos < 0) {
-			src_pos = -dst_pos;
+			src_pos -= dst_pos;
 			if (src_pos > src->size) return;
+			len += dst_pos;
 			dst_pos = 0;
 		}
 		if (dst_pos + len > dst->size) {
 			len = dst->size - dst_pos;
 			if (len < 1) return;
 		}
+		replaced = len;
 	}
+	if (len < 1) return;
 
-	memcpy(dst->data + dst_pos, src->data + src_pos, len);
+	flatten_buffer(src);
+	replace_pieces(dst, dst_pos, replaced, append_add(dst, src->data + src_pos, len), len);
 }
 
-void remove_buffer(buffer *buf, int off, int len) {
+void remove_buffer(buffer *buf, int64_t off, int64_t len) {
 	if (is_empty(buf) || off >= buf->size || off+len <= 0) return;
 
 	if (len <= 0) len = buf->size;
@@ -192,15 +566,176 @@ void remove_buffer(buffer *buf, int off, int len) {
 		len += off;
 		off = 0;
 	}
-	if (off+len >= buf->size) {
-		buf->size = off;
-		buf->data = realloc(buf->data, buf->size);
-		return;
+	if (off+len > buf->size) len = buf->size - off;
+
+	replace_pieces(buf, off, len, 0, 0);
+}
+
+// Appends an offset to a list of results, growing it the same way as add_byte
+void add_offset(buffer *results, int64_t off) {
+	if (results->size + (int64_t)sizeof(int64_t) > results->cap) {
+		results->cap = results->cap ? results->cap * 2 : 64 * (int64_t)sizeof(int64_t);
+		results->data = realloc(results->data, results->cap);
+	}
+	memcpy(results->data + results->size, &off, sizeof(int64_t));
+	results->size += sizeof(int64_t);
+}
+
+// Finds a byte string by first looking for places where both its first and last bytes match,
+// a vector's worth of positions at a time, and only comparing the rest there.
+// Wherever vectors aren't available, and for the last few positions, it's Horspool's algorithm instead
+typedef struct {
+	u8 *term;
+	int64_t len;
+	int64_t shift[256];
+} searcher;
+
+void init_searcher(searcher *s, u8 *term, int64_t len) {
+	s->term = term;
+	s->len = len;
+
+	int64_t i;
+	for (i = 0; i < 256; i++) s->shift[i] = len;
+	for (i = 0; i < len-1; i++) s->shift[term[i]] = len-1 - i;
+}
+
+// Returns the offset of the first match at or after from, or -1 if there isn't one
+int64_t find_next(searcher *s, u8 *data, int64_t size, int64_t from) {
+	int64_t m = s->len, i = from;
+	if (m < 1 || i < 0 || i + m > size) return -1;
+	if (m == 1) {
+		u8 *p = memchr(data + i, s->term[0], size - i);
+		return p ? p - data : -1;
+	}
+
+#if defined(SEARCH_AVX2)
+	__m256i first = _mm256_set1_epi8((char)s->term[0]);
+	__m256i last = _mm256_set1_epi8((char)s->term[m-1]);
+	for (; i + m-1 + 32 <= size; i += 32) {
+		__m256i a = _mm256_loadu_si256((__m256i*)(data + i));
+		__m256i b = _mm256_loadu_si256((__m256i*)(data + i + m-1));
+		unsigned mask = (unsigned)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			int64_t at = i + __builtin_ctz(mask);
+			if (!memcmp(data + at + 1, s->term + 1, m-2)) return at;
+		}
+	}
+#elif defined(SEARCH_SSE2)
+	__m128i first = _mm_set1_epi8((char)s->term[0]);
+	__m128i last = _mm_set1_epi8((char)s->term[m-1]);
+	for (; i + m-1 + 16 <= size; i += 16) {
+		__m128i a = _mm_loadu_si128((__m128i*)(data + i));
+		__m128i b = _mm_loadu_si128((__m128i*)(data + i + m-1));
+		unsigned mask = (unsigned)_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		for (; mask; mask &= mask - 1) {
+			int64_t at = i + __builtin_ctz(mask);
+			if (!memcmp(data + at + 1, s->term + 1, m-2)) return at;
+		}
+	}
+#endif
+
+	u8 end = s->term[m-1];
+	while (i + m <= size) {
+		u8 c = data[i + m-1];
+		if (c == end && !memcmp(data + i, s->term, m-1)) return i;
+		i += s->shift[c];
+	}
+	return -1;
+}
+
+// Big files are split into chunks, which a pool of threads take turns picking up.
+// Each chunk keeps its own results, so they can be put back together in order afterwards
+#define CHUNK_SIZE ((int64_t)16 << 20)
+
+typedef struct {
+	int64_t from, to;
+	buffer results;
+	buffer *hits; // per-pattern results, for search_patterns
+} job;
+
+typedef struct {
+	void (*func)(void *ctx, job *j);
+	void *ctx;
+	job *jobs;
+	int n_jobs, next;
+} job_queue;
+
+// HEXED_THREADS overrides the number of threads, otherwise it's one per online CPU
+int n_threads(void) {
+	char *env = getenv("HEXED_THREADS");
+	long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n > 1024 ? 1024 : n;
+}
+
+void *worker(void *arg) {
+	job_queue *q = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->n_jobs)
+		q->func(q->ctx, &q->jobs[i]);
+	return NULL;
+}
+
+// Runs func over every chunk of [0, size) and returns the chunks in order
+job *run_chunks(int64_t size, void (*func)(void*, job*), void *ctx, int *n_jobs) {
+	job_queue q = {.func = func, .ctx = ctx};
+	q.n_jobs = (size + CHUNK_SIZE-1) / CHUNK_SIZE;
+	q.jobs = calloc(q.n_jobs, sizeof(job));
+
+	int i, n = n_threads(), started = 0;
+	for (i = 0; i < q.n_jobs; i++) {
+		q.jobs[i].from = i * CHUNK_SIZE;
+		q.jobs[i].to = i < q.n_jobs-1 ? (i+1) * CHUNK_SIZE : size;
+	}
+	if (n > q.n_jobs) n = q.n_jobs;
+
+	// The calling thread does its share too. If a thread can't be started, the rest just do more
+	pthread_t *threads = calloc(n, sizeof(pthread_t));
+	for (i = 1; i < n; i++) {
+		if (pthread_create(&threads[started], NULL, worker, &q)) break;
+		started++;
+	}
+	worker(&q);
+	for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+	free(threads);
+
+	*n_jobs = q.n_jobs;
+	return q.jobs;
+}
+
+// Appends every chunk's results to one list (in order) and frees the chunks
+void merge_results(buffer *results, job *jobs, int n_jobs) {
+	int i;
+	for (i = 0; i < n_jobs; i++) {
+		buffer *r = &jobs[i].results;
+		if (results->size + r->size > results->cap) {
+			results->cap = results->size + r->size;
+			results->data = realloc(results->data, results->cap);
+		}
+		if (r->size) memcpy(results->data + results->size, r->data, r->size);
+		results->size += r->size;
+		close_buffer(r);
 	}
+	free(jobs);
+}
 
-	memmove(buf->data + off, buf->data + off+len, buf->size - (off+len));
-	buf->size -= len;
-	buf->data = realloc(buf->data, buf->size);
+typedef struct {
+	searcher s;
+	u8 *data;
+	int64_t size;
+} search_ctx;
+
+// Matches that start near the end of a chunk run up to len-1 bytes into the next one
+void search_chunk(void *ctx, job *j) {
+	search_ctx *c = ctx;
+	int64_t i = j->from, end = j->to + c->s.len - 1;
+	if (end > c->size) end = c->size;
+
+	while ((i = find_next(&c->s, c->data, end, i)) >= 0) {
+		add_offset(&j->results, i);
+		i++;
+	}
 }
 
 void search_buffer(buffer *results, buffer *buf, buffer *term) {
@@ -208,42 +743,722 @@ void search_buffer(buffer *results, buffer *buf, buffer *term) {
 		is_empty(term) || term->size > buf->size) return;
 
 	close_buffer(results);
+	flatten_buffer(buf);
+	if (buf->mapped) madvise(buf->data, buf->size, MADV_SEQUENTIAL);
 
-	int i, j, *res = NULL, count = 0;
-	for (i = 0; i < buf->size - term->size; i++) {
-		for (j = 0; j < term->size; j++) {
-			if (buf->data[i+j] != term->data[j]) break;
+	search_ctx ctx = {.data = buf->data, .size = buf->size};
+	init_searcher(&ctx.s, term->data, term->size);
+
+	int n_jobs;
+	job *jobs = run_chunks(buf->size, search_chunk, &ctx, &n_jobs);
+	merge_results(results, jobs, n_jobs);
+
+	int64_t i, count = results->size / sizeof(int64_t);
+	for (i = 0; i < count; i++) printf("%#llx\n", (long long)((int64_t*)results->data)[i]);
+	printf("\nTotal results: %lld\n\n", (long long)count);
+}
+
+// Swaps every len-byte hit for the replacement. Hits that overlap an earlier one are left alone.
+// A replacement of the same size is patched in place, so only those bytes get written back.
+// Otherwise the new file is written in one pass, straight from the unchanged spans and the replacement
+int replace_results(buffer *buf, buffer *results, int64_t len, buffer *replace) {
+	int64_t *hits = (int64_t*)results->data, n = results->size / sizeof(int64_t);
+	int64_t i, end = 0, skipped = 0, shift = 0;
+	int res = 0;
+
+	// Only regular files can be replaced, anything else has to be edited where it is
+	struct stat st;
+	if (replace->size == len || stat(buf->name, &st) < 0 || !S_ISREG(st.st_mode)) {
+		int64_t start = append_add(buf, replace->data, replace->size);
+		for (i = 0; i < n; i++) {
+			if (hits[i] < end) {
+				skipped++;
+				continue;
+			}
+			replace_pieces(buf, hits[i] + shift, len, start, replace->size);
+			shift += replace->size - len;
+			end = hits[i] + len;
 		}
-		if (j == term->size) {
-			res = realloc(res, ++count * sizeof(int));
-			res[count-1] = i;
-			printf("%#x\n", i);
+		res = save_buffer(buf);
+	}
+	else {
+		char *temp, *path;
+		FILE *f = open_replacement(buf->name, &temp, &path);
+		if (!f) {
+			printf("Could not write to \"%s\"\n", buf->name);
+			return -1;
+		}
+
+		flatten_buffer(buf);
+		for (i = 0; i < n && res == 0; i++) {
+			if (hits[i] < end) {
+				skipped++;
+				continue;
+			}
+			if (fwrite(buf->data + end, 1, hits[i] - end, f) != (size_t)(hits[i] - end) ||
+				(replace->size > 0 && fwrite(replace->data, 1, replace->size, f) != (size_t)replace->size)) res = -1;
+			end = hits[i] + len;
+		}
+		if (res == 0 && fwrite(buf->data + end, 1, buf->size - end, f) != (size_t)(buf->size - end)) res = -1;
+
+		if (finish_replacement(f, res, temp, path) < 0) {
+			printf("Could not write to \"%s\"\n", buf->name);
+			return -1;
 		}
 	}
-	printf("\nTotal results: %d\n\n", count);
 
-	results->data = (u8*)res;
-	results->size = count * sizeof(int);
+	if (skipped) printf("Skipped %lld results that overlap another\n", (long long)skipped);
+	return res;
 }
 
+double seconds_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Times a search of the whole buffer with a plain double loop, with the C library's memmem, and with find_next
+void bench_search(buffer *buf, buffer *term) {
+	if (is_empty(buf) || is_empty(term) || term->size > buf->size) return;
+	flatten_buffer(buf);
+
+	u8 *data = buf->data, *t = term->data;
+	int64_t size = buf->size, m = term->size;
+	int64_t i, j, count;
+	struct timespec start;
+
+	// Read everything once first, so the first method doesn't also pay for reading the file in
+	volatile u8 sum = 0;
+	for (i = 0; i < size; i += 4096) sum += data[i];
+
+	const char *names[] = {"naive", "memmem", "find_next"};
+	int method;
+	for (method = 0; method < 3; method++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		count = 0;
+		if (method == 0) {
+			for (i = 0; i <= size - m; i++) {
+				for (j = 0; j < m && data[i+j] == t[j]; j++);
+				count += j == m;
+			}
+		}
+		else if (method == 1) {
+			u8 *p = data;
+			while ((p = memmem(p, size - (p - data), t, m))) {
+				count++;
+				p++;
+			}
+		}
+		else {
+			searcher s;
+			init_searcher(&s, t, m);
+			for (i = 0; (i = find_next(&s, data, size, i)) >= 0; i++) count++;
+		}
+		double secs = seconds_since(&start);
+		printf("%-10s %lld results in %.3fs (%.2f GB/s)\n", names[method], (long long)count, secs,
+			secs > 0 ? size / secs / 1e9 : 0.0);
+	}
+}
+
+// A set of patterns to look for all at once. Each pattern's longest run of fully known bytes (its anchor)
+// goes into an Aho-Corasick automaton, and only where an anchor turns up is the rest of that pattern checked
+typedef struct {
+	char *name;
+	buffer bytes, mask;
+	int64_t anchor, anchor_len; // where the anchor starts in the pattern, and how long it is
+} pattern;
+
+typedef struct {
+	pattern *pats;
+	int n_pats;
+	int64_t max_len;
+	int32_t (*next)[256]; // full transition table, so the scan never has to follow failure links
+	int32_t *out;  // first pattern whose anchor ends at each state, or -1
+	int32_t *dict; // nearest state down the failure chain that has an output, or 0
+	int32_t *same; // next pattern with the same anchor, or -1
+	int n_states;
+} pattern_set;
+
+void close_patterns(pattern_set *set) {
+	int i;
+	for (i = 0; i < set->n_pats; i++) {
+		free(set->pats[i].name);
+		close_buffer(&set->pats[i].bytes);
+		close_buffer(&set->pats[i].mask);
+	}
+	free(set->pats);
+	free(set->next);
+	free(set->out);
+	free(set->dict);
+	free(set->same);
+	memset(set, 0, sizeof(pattern_set));
+}
+
+// Adds a pattern written the same way as byte data on the command line, optionally preceded by "name ="
+int add_pattern(pattern_set *set, char *line) {
+	char *text = line, *name = line;
+	int i, quoted = 0;
+	for (i = 0; line[i]; i++) {
+		if (line[i] == '"') quoted = !quoted;
+		if (line[i] == '=' && !quoted) {
+			text = &line[i+1];
+			while (i > 0 && (line[i-1] == ' ' || line[i-1] == '\t')) i--;
+			line[i] = 0;
+			break;
+		}
+	}
+
+	pattern p = {0};
+	read_pattern(&p.bytes, &p.mask, &text, 1);
+	if (!p.bytes.size) return 0;
+
+	// Wildcard nibbles are cleared in the pattern itself, so checking a byte is just (data & mask) == byte
+	int64_t j, run = 0;
+	for (j = 0; j < p.bytes.size; j++) {
+		p.bytes.data[j] &= p.mask.data[j];
+		run = p.mask.data[j] == 0xff ? run + 1 : 0;
+		if (run > p.anchor_len) {
+			p.anchor_len = run;
+			p.anchor = j+1 - run;
+		}
+	}
+	if (!p.anchor_len) {
+		printf("Pattern \"%s\" needs at least one whole byte\n", name);
+		close_buffer(&p.bytes);
+		close_buffer(&p.mask);
+		return -1;
+	}
+
+	p.name = strdup(name);
+	if (p.bytes.size > set->max_len) set->max_len = p.bytes.size;
+	set->pats = realloc(set->pats, (set->n_pats+1) * sizeof(pattern));
+	set->pats[set->n_pats++] = p;
+	return 0;
+}
+
+// Copies the line at pos without its line ending or trailing spaces, and returns where the next one starts
+int64_t read_line(buffer *file, int64_t pos, char **line) {
+	int64_t len;
+	for (len = 0; pos+len < file->size && file->data[pos+len] != '\n'; len++);
+	*line = realloc(*line, len+1);
+	memcpy(*line, file->data + pos, len);
+
+	int64_t next = pos + len+1;
+	while (len > 0 && ((*line)[len-1] == '\r' || (*line)[len-1] == ' ' || (*line)[len-1] == '\t')) len--;
+	(*line)[len] = 0;
+	return next;
+}
+
+// Reads one pattern per line, skipping blank lines and lines starting with '#'
+int load_patterns(pattern_set *set, buffer *file) {
+	memset(set, 0, sizeof(pattern_set));
+	if (is_empty(file)) return -1;
+	flatten_buffer(file);
+
+	char *line = NULL;
+	int64_t i = 0;
+	while (i < file->size) {
+		i = read_line(file, i, &line);
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p || *p == '#') continue;
+		if (add_pattern(set, p) < 0) {
+			free(line);
+			close_patterns(set);
+			return -1;
+		}
+	}
+	free(line);
+	return set->n_pats ? 0 : -1;
+}
+
+void build_patterns(pattern_set *set) {
+	int64_t total = 1;
+	int i, c;
+	for (i = 0; i < set->n_pats; i++) total += set->pats[i].anchor_len;
+
+	set->next = malloc(total * sizeof(*set->next));
+	set->out = malloc(total * sizeof(int32_t));
+	set->dict = calloc(total, sizeof(int32_t));
+	set->same = malloc(set->n_pats * sizeof(int32_t));
+	int32_t *fail = calloc(total, sizeof(int32_t));
+	int32_t *queue = malloc(total * sizeof(int32_t));
+
+	memset(set->next, 0xff, total * sizeof(*set->next));
+	memset(set->out, 0xff, total * sizeof(int32_t));
+	set->n_states = 1;
+
+	// Put every anchor into a trie
+	for (i = 0; i < set->n_pats; i++) {
+		pattern *p = &set->pats[i];
+		int64_t j;
+		int32_t s = 0;
+		for (j = 0; j < p->anchor_len; j++) {
+			u8 b = p->bytes.data[p->anchor + j];
+			if (set->next[s][b] < 0) set->next[s][b] = set->n_states++;
+			s = set->next[s][b];
+		}
+		set->same[i] = set->out[s];
+		set->out[s] = i;
+	}
+
+	// Then fill in the missing transitions breadth-first, each one borrowed from the state's failure link
+	int head = 0, tail = 0;
+	for (c = 0; c < 256; c++) {
+		int32_t t = set->next[0][c];
+		if (t < 0) set->next[0][c] = 0;
+		else queue[tail++] = t;
+	}
+	while (head < tail) {
+		int32_t s = queue[head++];
+		for (c = 0; c < 256; c++) {
+			int32_t t = set->next[s][c];
+			if (t < 0) {
+				set->next[s][c] = set->next[fail[s]][c];
+				continue;
+			}
+			int32_t f = set->next[fail[s]][c];
+			fail[t] = f;
+			set->dict[t] = set->out[f] >= 0 ? f : set->dict[f];
+			queue[tail++] = t;
+		}
+	}
+
+	free(fail);
+	free(queue);
+}
+
+// Records hits for every pattern that starts in [from, to). The scan carries on past to by up to
+// the longest pattern's length, so that a range can be searched on its own without missing anything
+void match_patterns(pattern_set *set, buffer *hits, u8 *data, int64_t size, int64_t from, int64_t to) {
+	int64_t i, stop = to + set->max_len - 1;
+	if (stop > size) stop = size;
+
+	int32_t st = 0;
+	for (i = from; i < stop; i++) {
+		st = set->next[st][data[i]];
+		int32_t s = set->out[st] >= 0 ? st : set->dict[st];
+		for (; s > 0; s = set->dict[s]) {
+			int32_t n;
+			for (n = set->out[s]; n >= 0; n = set->same[n]) {
+				pattern *p = &set->pats[n];
+				int64_t at = i+1 - p->anchor_len - p->anchor, j;
+				if (at < from || at >= to || at + p->bytes.size > size) continue;
+
+				u8 *d = data + at, *b = p->bytes.data, *m = p->mask.data;
+				for (j = 0; j < p->bytes.size && (d[j] & m[j]) == b[j]; j++);
+				if (j == p->bytes.size) add_offset(&hits[n], at);
+			}
+		}
+	}
+}
+
+int compare_offsets(const void *a, const void *b) {
+	int64_t x = *(int64_t*)a, y = *(int64_t*)b;
+	return (x > y) - (x < y);
+}
+
+typedef struct {
+	pattern_set *set;
+	u8 *data;
+	int64_t size;
+} patterns_ctx;
+
+void patterns_chunk(void *ctx, job *j) {
+	patterns_ctx *c = ctx;
+	j->hits = calloc(c->set->n_pats, sizeof(buffer));
+	match_patterns(c->set, j->hits, c->data, c->size, j->from, j->to);
+}
+
+// Looks for every pattern in one pass. Offsets of all hits go into results, sorted
+void search_patterns(buffer *results, buffer *buf, buffer *file) {
+	if (!results || is_empty(buf)) return;
+
+	pattern_set set;
+	if (load_patterns(&set, file) < 0) {
+		printf("No patterns to search for\n");
+		return;
+	}
+	build_patterns(&set);
+
+	close_buffer(results);
+	flatten_buffer(buf);
+	if (buf->mapped) madvise(buf->data, buf->size, MADV_SEQUENTIAL);
+
+	patterns_ctx ctx = {&set, buf->data, buf->size};
+	int n_jobs;
+	job *jobs = run_chunks(buf->size, patterns_chunk, &ctx, &n_jobs);
+
+	int i, k;
+	int64_t j, count = 0;
+	for (i = 0; i < set.n_pats; i++) {
+		int64_t n = 0;
+		for (k = 0; k < n_jobs; k++) n += jobs[k].hits[i].size / sizeof(int64_t);
+		if (!n) continue;
+
+		printf("%s: %lld results\n", set.pats[i].name, (long long)n);
+		for (k = 0; k < n_jobs; k++) {
+			buffer *h = &jobs[k].hits[i];
+			int64_t *offs = (int64_t*)h->data;
+			for (j = 0; j < h->size / (int64_t)sizeof(int64_t); j++) {
+				printf("%#llx\n", (long long)offs[j]);
+				add_offset(results, offs[j]);
+			}
+		}
+		putchar('\n');
+		count += n;
+	}
+	printf("Total results: %lld\n", (long long)count);
+
+	for (k = 0; k < n_jobs; k++) {
+		for (i = 0; i < set.n_pats; i++) close_buffer(&jobs[k].hits[i]);
+		free(jobs[k].hits);
+	}
+	free(jobs);
+	if (count) qsort(results->data, count, sizeof(int64_t), compare_offsets);
+	close_patterns(&set);
+}
+
+// Returns the first position from i where a and b differ, or end if there isn't one
+int64_t next_diff(u8 *a, u8 *b, int64_t i, int64_t end) {
+#if defined(SEARCH_AVX2)
+	for (; i + 32 <= end; i += 32) {
+		unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((__m256i*)(a + i)), _mm256_loadu_si256((__m256i*)(b + i))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#elif defined(SEARCH_SSE2)
+	for (; i + 16 <= end; i += 16) {
+		unsigned mask = 0xffff & ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((__m128i*)(a + i)), _mm_loadu_si128((__m128i*)(b + i))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < end && a[i] == b[i]; i++);
+	return i;
+}
+
+// Returns the first position from i where a and b are the same again, or end
+int64_t next_same(u8 *a, u8 *b, int64_t i, int64_t end) {
+#if defined(SEARCH_AVX2)
+	for (; i + 32 <= end; i += 32) {
+		unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((__m256i*)(a + i)), _mm256_loadu_si256((__m256i*)(b + i))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#elif defined(SEARCH_SSE2)
+	for (; i + 16 <= end; i += 16) {
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((__m128i*)(a + i)), _mm_loadu_si128((__m128i*)(b + i))));
+		if (mask) return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < end && a[i] != b[i]; i++);
+	return i;
+}
+
+typedef struct {
+	buffer *a, *b;
+} diff_ctx;
+
+// Records each run of differing bytes as a (start, length) pair. Once a chunk of a mapped file
+// has been compared it's dropped from memory, so files bigger than RAM stream through
+void diff_chunk(void *ctx, job *j) {
+	diff_ctx *c = ctx;
+	u8 *a = c->a->data, *b = c->b->data;
+	int64_t i = j->from;
+	while ((i = next_diff(a, b, i, j->to)) < j->to) {
+		int64_t end = next_same(a, b, i, j->to);
+		add_offset(&j->results, i);
+		add_offset(&j->results, end - i);
+		i = end;
+	}
+
+	if (c->a->mapped) madvise(a + j->from, j->to - j->from, MADV_DONTNEED);
+	if (c->b->mapped) madvise(b + j->from, j->to - j->from, MADV_DONTNEED);
+}
+
+// Each result is a (start, length) pair. Bytes past the end of the shorter file count as one more run
 void diff_buffer(buffer *results, buffer *a, buffer *b) {
 	if (!results || is_empty(a) || is_empty(b)) return;
 
 	close_buffer(results);
+	flatten_buffer(a);
+	flatten_buffer(b);
+	if (a->mapped) madvise(a->data, a->size, MADV_SEQUENTIAL);
+	if (b->mapped) madvise(b->data, b->size, MADV_SEQUENTIAL);
+
+	int64_t sz = a->size < b->size ? a->size : b->size;
+	diff_ctx ctx = {a, b};
+	int n_jobs, k;
+	job *jobs = run_chunks(sz, diff_chunk, &ctx, &n_jobs);
+
+	// A run can carry on into the next chunk, in which case the two halves are joined back up
+	int64_t i, *runs;
+	for (k = 0; k < n_jobs; k++) {
+		buffer *r = &jobs[k].results;
+		runs = (int64_t*)r->data;
+		for (i = 0; i < r->size / (int64_t)sizeof(int64_t); i += 2) {
+			int64_t *last = results->size ? (int64_t*)(results->data + results->size) - 2 : NULL;
+			if (last && last[0] + last[1] == runs[i]) last[1] += runs[i+1];
+			else {
+				add_offset(results, runs[i]);
+				add_offset(results, runs[i+1]);
+			}
+		}
+		close_buffer(r);
+	}
+	free(jobs);
+
+	if (a->size != b->size) {
+		add_offset(results, sz);
+		add_offset(results, (a->size > b->size ? a->size : b->size) - sz);
+	}
+
+	int64_t count = results->size / (2 * sizeof(int64_t)), total = 0;
+	runs = (int64_t*)results->data;
+	for (i = 0; i < count; i++) {
+		printf("%#llx +%lld%s\n", (long long)runs[2*i], (long long)runs[2*i+1],
+			runs[2*i] == sz ? " (past the end of the shorter file)" : "");
+		total += runs[2*i+1];
+	}
+	printf("\nTotal results: %lld runs, %lld bytes\n", (long long)count, (long long)total);
+}
+
+// Saves every offset covered by a list of (start, length) runs, which is what -v takes
+int save_runs(buffer *runs, char *name) {
+	FILE *f = fopen(name, "wb");
+	if (!f) {
+		printf("Could not write to \"%s\"\n", name);
+		return -1;
+	}
+
+	int64_t i, j, *r = (int64_t*)runs->data;
+	int res = 0;
+	for (i = 0; i < runs->size / (int64_t)sizeof(int64_t) && res == 0; i += 2) {
+		for (j = r[i]; j < r[i] + r[i+1]; j++) {
+			if (fwrite(&j, sizeof(int64_t), 1, f) != 1) {
+				res = -1;
+				break;
+			}
+		}
+	}
+	if (fclose(f) != 0) res = -1;
+	if (res < 0) printf("Could not write to \"%s\"\n", name);
+	return res;
+}
+
+// Finds what was inserted, removed, changed or copied between two files, even when everything after has shifted.
+// Like rsync, every block of a is listed by its hash, and a hash of a window rolling along b
+// is looked up at each byte. Where a block matches, the match is grown in both directions,
+// and whatever lies between two matches is what changed
+#define HASH_MUL 0x100000001b3ULL
+
+typedef struct {
+	uint64_t hash;
+	int64_t off;
+} block_hash;
+
+int compare_blocks(const void *x, const void *y) {
+	const block_hash *a = x, *b = y;
+	if (a->hash != b->hash) return a->hash < b->hash ? -1 : 1;
+	return (a->off > b->off) - (a->off < b->off);
+}
+
+uint64_t mix_hash(uint64_t h) {
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	return h ^ (h >> 32);
+}
 
-	int sz = a->size < b->size ? a->size : b->size;
-	int i, *diff = NULL, count = 0;
-	for (i = 0; i < sz; i++) {
-		if (a->data[i] == b->data[i]) continue;
+uint64_t hash_block(u8 *p, int64_t len) {
+	uint64_t h = 0;
+	int64_t i;
+	for (i = 0; i < len; i++) h = h * HASH_MUL + p[i];
+	return h;
+}
 
-		diff = realloc(diff, ++count * sizeof(int));
-		diff[count-1] = i;
-		printf("%#x\n", i);
+// Prints what happened between two matches, leaving out bytes at either end that are the same anyway.
+// Returns how many were left out
+int64_t print_change(buffer *a, buffer *b, int64_t a_off, int64_t a_len, int64_t b_off, int64_t b_len, int64_t *count) {
+	int64_t pre = 0, post = 0;
+	if (a_len > 0 && b_len > 0) {
+		pre = next_diff(a->data + a_off, b->data + b_off, 0, a_len < b_len ? a_len : b_len);
+		a_off += pre;
+		b_off += pre;
+		a_len -= pre;
+		b_len -= pre;
+		while (post < a_len && post < b_len && a->data[a_off + a_len - post - 1] == b->data[b_off + b_len - post - 1]) post++;
+		a_len -= post;
+		b_len -= post;
 	}
-	printf("\nTotal results: %d\n", count);
+	if (a_len <= 0 && b_len <= 0) return pre + post;
+	if (a_len <= 0)
+		printf("inserted %#llx +%lld\n", (long long)b_off, (long long)b_len);
+	else if (b_len <= 0)
+		printf("removed  %#llx +%lld\n", (long long)a_off, (long long)a_len);
+	else
+		printf("changed  %#llx +%lld -> %#llx +%lld\n",
+			(long long)a_off, (long long)a_len, (long long)b_off, (long long)b_len);
+	(*count)++;
+	return pre + post;
+}
 
-	results->data = (u8*)diff;
-	results->size = count * sizeof(int);
+// Grows a match of a at m with b at j backwards (no further than the floors) and then forwards as far as it goes
+int64_t grow_match(buffer *a, buffer *b, int64_t m, int64_t j, int64_t a_floor, int64_t b_floor, int64_t *a_start, int64_t *b_start) {
+	int64_t back = 0;
+	while (j - back > b_floor && m - back > a_floor && a->data[m - back - 1] == b->data[j - back - 1]) back++;
+	*a_start = m - back;
+	*b_start = j - back;
+	int64_t limit = a->size - m < b->size - j ? a->size - m : b->size - j;
+	return back + next_diff(a->data + m, b->data + j, 0, limit);
+}
+
+// Whether a match ending here ends where a run of padding does in both files
+int ends_padding(buffer *a, buffer *b, int64_t a_stop, int64_t b_stop, u8 pad) {
+	return (a_stop == a->size || a->data[a_stop] != pad) && (b_stop == b->size || b->data[b_stop] != pad);
+}
+
+void diff_blocks(buffer *a, buffer *b, int64_t block) {
+	if (is_empty(a) || is_empty(b)) return;
+	flatten_buffer(a);
+	flatten_buffer(b);
+	if (b->mapped) madvise(b->data, b->size, MADV_SEQUENTIAL);
+
+	// By default, blocks get bigger with the file so that there are no more than about a million of them
+	if (block <= 0) {
+		block = 32;
+		while (a->size / block > (1 << 20)) block *= 2;
+	}
+
+	u8 *ad = a->data, *bd = b->data;
+	int64_t n_blocks = a->size / block, i;
+
+	// Blocks are sorted by hash and then offset, so that when a block appears more than once (like padding),
+	// the copy just after the last match can be picked out instead of one from elsewhere
+	block_hash *blocks = malloc((n_blocks ? n_blocks : 1) * sizeof(block_hash));
+	for (i = 0; i < n_blocks; i++) blocks[i] = (block_hash){hash_block(ad + i * block, block), i * block};
+	qsort(blocks, n_blocks, sizeof(block_hash), compare_blocks);
+
+	// A bitmap of (mixed) hashes saves searching the list at most bytes
+	int bits = 10;
+	while (((int64_t)1 << bits) < n_blocks * 64) bits++;
+	uint64_t bit_mask = ((uint64_t)1 << bits) - 1;
+	u8 *seen = calloc(((int64_t)1 << bits) / 8, 1);
+	for (i = 0; i < n_blocks; i++) {
+		uint64_t s = mix_hash(blocks[i].hash) & bit_mask;
+		seen[s >> 3] |= 1 << (s & 7);
+	}
+
+	uint64_t out_mul = 1;
+	for (i = 0; i < block; i++) out_mul *= HASH_MUL;
+
+	// b_end is where the last match finished, and a_end is the furthest any match in order has got into a.
+	// Matches from before a_end are copies, which don't move it back, so nothing already matched is reported again
+	int64_t a_end = 0, b_end = 0, j = 0, count = 0, same = 0, dropped = 0;
+	int64_t skip_until = 0; // only carry on from the last match until here, see below
+	uint64_t h = 0;
+	int fresh = 1;
+	while (n_blocks && j + block <= b->size) {
+		if (fresh) h = hash_block(bd + j, block);
+		fresh = 0;
+
+		// Carrying on from the last match is better than an identical block elsewhere
+		int64_t match = -1, expect = a_end + (j - b_end);
+		if (expect + block <= a->size && ad[expect] == bd[j] && !memcmp(ad + expect, bd + j, block)) match = expect;
+
+		// Otherwise it's the nearest block from a_end onwards, or the nearest one before it
+		uint64_t s = mix_hash(h) & bit_mask;
+		if (match < 0 && j >= skip_until && (seen[s >> 3] & (1 << (s & 7)))) {
+			int64_t lo = 0, hi = n_blocks, k, tries;
+			while (lo < hi) {
+				int64_t mid = lo + (hi - lo) / 2;
+				if (blocks[mid].hash < h || (blocks[mid].hash == h && blocks[mid].off < a_end)) lo = mid + 1;
+				else hi = mid;
+			}
+			for (k = lo, tries = 0; match < 0 && k < n_blocks && blocks[k].hash == h && tries < 8; k++, tries++) {
+				if (!memcmp(ad + blocks[k].off, bd + j, block)) match = blocks[k].off;
+			}
+			// A block that's in a more than once, like padding, says nothing about where a copy came from
+			int repeated = (lo >= 2 && blocks[lo-2].hash == h) || (lo < n_blocks && blocks[lo].hash == h);
+			for (k = lo-1, tries = 0; match < 0 && !repeated && k >= 0 && blocks[k].hash == h && tries < 8; k--, tries++) {
+				if (!memcmp(ad + blocks[k].off, bd + j, block)) match = blocks[k].off;
+			}
+		}
+
+		if (match < 0) {
+			if (j + block < b->size) h = h * HASH_MUL + bd[j + block] - bd[j] * out_mul;
+			j++;
+			continue;
+		}
+
+		// Grow the match backwards (not past the last one) and then forwards as far as it goes
+		int64_t a_start, b_start, c_a, c_b, c_len;
+		int64_t len = grow_match(a, b, match, j, match >= a_end ? a_end : 0, b_end, &a_start, &b_start);
+
+		// Padding matches itself at any offset, so the offset found first needn't be the one where it ends in both files.
+		// If it isn't, bytes inserted just before it (matching from a_end) or removed (sliding back through the padding in a)
+		// are tried instead, as long as that gets at least as far through both files
+		u8 pad = bd[j];
+		if (bd[j + block - 1] == pad && !memcmp(bd + j, bd + j + 1, block - 1) && !ends_padding(a, b, a_start + len, b_start + len, pad)) {
+			if (j > b_end) {
+				c_len = grow_match(a, b, a_end, j, a_end, b_end, &c_a, &c_b);
+				if (ends_padding(a, b, c_a + c_len, c_b + c_len, pad) && c_a + c_len >= a_start + len && c_b + c_len >= b_start + len)
+					a_start = c_a, b_start = c_b, len = c_len;
+			}
+			int64_t k = a_start;
+			while (b_start == b_end && k > a_end && ad[k - 1] == pad) k--;
+			if (k < a_start) {
+				c_len = grow_match(a, b, k, b_start, a_end, b_end, &c_a, &c_b);
+				if (ends_padding(a, b, c_a + c_len, c_b + c_len, pad) && c_a + c_len >= a_start + len && c_b + c_len >= b_start + len)
+					a_start = c_a, b_start = c_b, len = c_len;
+			}
+		}
+
+		// A short match anywhere but straight after the last one is weak evidence, and taking it
+		// would mean a lot of jumping around a. The rest of it would match the same way,
+		// so there's no point looking anywhere else until after it
+		if (a_start - a_end != b_start - b_end && len < 4 * block) {
+			skip_until = j + len;
+			if (j + block < b->size) h = h * HASH_MUL + bd[j + block] - bd[j] * out_mul;
+			j++;
+			continue;
+		}
+
+		// A copy that runs on past a_end is in order from there, with what comes before that in b inserted
+		if (a_start < a_end && a_start + len > a_end) {
+			b_start += a_end - a_start;
+			len -= a_end - a_start;
+			a_start = a_end;
+		}
+
+		same += len;
+		if (a_start >= a_end) {
+			same += print_change(a, b, a_end, a_start - a_end, b_end, b_start - b_end, &count);
+			a_end = a_start + len;
+		}
+		else {
+			// The match comes from earlier in a, so it was copied (or moved) there
+			print_change(a, b, a_end, 0, b_end, b_start - b_end, &count);
+			printf("copied   %#llx +%lld -> %#llx\n", (long long)a_start, (long long)len, (long long)b_start);
+			count++;
+		}
+		b_end = b_start + len;
+		j = b_end;
+		fresh = 1;
+
+		// What's behind the last match won't be looked at again
+		if (b->mapped && b_end - dropped >= CHUNK_SIZE) {
+			madvise(bd + dropped, (b_end & ~(int64_t)4095) - dropped, MADV_DONTNEED);
+			dropped = b_end & ~(int64_t)4095;
+		}
+	}
+	same += print_change(a, b, a_end, a->size - a_end, b_end, b->size - b_end, &count);
+
+	printf("\nTotal results: %lld changes, %lld bytes the same (blocks of %lld)\n",
+		(long long)count, (long long)same, (long long)block);
+	free(blocks);
+	free(seen);
 }
 
 #ifndef _WIN32_
@@ -254,8 +1469,9 @@ void diff_buffer(buffer *results, buffer *a, buffer *b) {
 	#define PRINT_HL_END
 #endif
 
-void view_buffer(buffer *b, int off, int len, buffer *offsets) {
+void view_buffer(buffer *b, int64_t off, int64_t len, buffer *offsets) {
 	if (is_empty(b) || off >= b->size) return;
+	flatten_buffer(b);
 
 	if (len <= 0) len = b->size;
 	if (off+len <= 0) return;
@@ -267,7 +1483,8 @@ void view_buffer(buffer *b, int off, int len, buffer *offsets) {
 	if (off+len > b->size)
 		len = b->size - off;
 
-	int n_digits = 0, x = (off+len-1) & ~0xf;
+	int n_digits = 0;
+	int64_t x = (off+len-1) & ~0xf;
 	if (x) {
 		while (x) {
 			n_digits++;
@@ -279,9 +1496,10 @@ void view_buffer(buffer *b, int off, int len, buffer *offsets) {
 	char *blank = calloc(50, 1);
 	memset(blank, ' ', 48);
 
-	int hl_idx = 0, old_idx = 0;
-	int i = 0, idx, mode = 0, hl = 0, row_end;
-	int *offs = offsets ? (int*)offsets->data : NULL;
+	int64_t hl_idx = 0, old_idx = 0;
+	int64_t i = 0, idx;
+	int mode = 0, hl = 0, row_end;
+	int64_t *offs = offsets ? (int64_t*)offsets->data : NULL;
 	u8 *p = NULL;
 	while (i < len) {
 		idx = off + i;
@@ -289,7 +1507,7 @@ void view_buffer(buffer *b, int off, int len, buffer *offsets) {
 		row_end = i >= ((len-1) & ~0xf) ?
 			((len-1) & 0xf) : 0xf;
 
-		if (offsets && hl_idx < offsets->size / sizeof(int) &&
+		if (offsets && hl_idx < offsets->size / sizeof(int64_t) &&
 		  idx == offs[hl_idx]) {
 			PRINT_HL;
 			hl = 1;
@@ -297,7 +1515,7 @@ void view_buffer(buffer *b, int off, int len, buffer *offsets) {
 		}
 		if (!mode) {
 			if (i % 16 == 0) {
-				printf(" %0*x | ", n_digits, idx);
+				printf(" %0*llx | ", n_digits, (long long)idx);
 				old_idx = hl_idx;
 			}
 			printf("%02x ", *p);
@@ -321,12 +1539,149 @@ void view_buffer(buffer *b, int off, int len, buffer *offsets) {
 		}
 		i++;
 	}
-	printf(" %0*x\n", n_digits, off+len);
+	printf(" %0*llx\n", n_digits, (long long)(off+len));
 
 	free(blank);
 }
 
-char *options = "nNwpifFcCrsSdv";
+// Splits off the next word of a line, or returns NULL if there isn't one
+char *next_word(char **str) {
+	char *p = *str;
+	while (*p == ' ' || *p == '\t') p++;
+	if (!*p) return NULL;
+
+	char *word = p;
+	while (*p && *p != ' ' && *p != '\t') p++;
+	if (*p) *p++ = 0;
+	*str = p;
+	return word;
+}
+
+// Runs one line of a script: an option letter from p, i, f, F, c, C, r or w (with or without a '-'),
+// followed by the same arguments it takes on the command line, minus the file
+int run_edit(buffer *buf, char *line, buffer *src) {
+	char *rest = line, *op = next_word(&rest);
+	if (op && *op == '-') op++;
+	if (!op || !*op || op[1] || !strchr("pifFcCrw", *op)) return -1;
+
+	char *words[4] = {0};
+	int i, n = 0, need = strchr("rw", *op) ? 1 : 2;
+	for (i = 0; i < 4; i++) {
+		// Byte data for -p and -i is the whole rest of the line, so it can have spaces and quotes in it
+		if ((*op == 'p' || *op == 'i') && i == 1) {
+			while (*rest == ' ' || *rest == '\t') rest++;
+			if (*rest) words[n++] = rest;
+			break;
+		}
+		if (!(words[i] = next_word(&rest))) break;
+		n++;
+	}
+	if (n < need) return -1;
+
+	buffer temp = {0};
+	int64_t off = read_number(words[0]), len = 0, from = 0;
+	u8 byte = 0;
+	switch (*op) {
+	case 'p':
+	case 'i':
+		read_array(&temp, &words[1], 1);
+		apply_buffer(buf, &temp, off, 0, 0, *op == 'i');
+		break;
+
+	case 'f':
+	case 'F':
+		if (n > 2) byte = (u8)read_number(words[2]);
+		create_filler(&temp, byte, read_number(words[1]));
+		apply_buffer(buf, &temp, off, 0, 0, *op == 'F');
+		break;
+
+	case 'c':
+	case 'C':
+		if (n > 2) from = read_number(words[2]);
+		if (n > 3) len = read_number(words[3]);
+
+		// Copying from the file being edited has to see what the lines before did to it, not what's on disk
+		struct stat st_src, st_buf;
+		if (stat(words[1], &st_src) == 0 && stat(buf->name, &st_buf) == 0 &&
+			st_src.st_dev == st_buf.st_dev && st_src.st_ino == st_buf.st_ino) {
+			if (from < 0) from = 0;
+			if (from >= buf->size) break;
+			if (len < 1 || from + len > buf->size) len = buf->size - from;
+
+			temp.data = malloc(len);
+			temp.size = temp.cap = len;
+			read_buffer(buf, from, len, temp.data);
+			apply_buffer(buf, &temp, off, 0, 0, *op == 'C');
+			break;
+		}
+
+		// Copying from the same file over and over is common, so it stays loaded until a different one is needed
+		if (!src->name || strcmp(src->name, words[1])) {
+			if (load_file(src, words[1]) < 0) {
+				printf("Could not open \"%s\"\n", words[1]);
+				return -2;
+			}
+		}
+		apply_buffer(buf, src, off, from, len, *op == 'C');
+		break;
+
+	case 'r':
+		if (n > 1) len = read_number(words[1]);
+		remove_buffer(buf, off, len);
+		break;
+
+	case 'w': // the first number is the bytes per swap, and the offset comes after it
+		if (n > 1) from = read_number(words[1]);
+		if (n > 2) len = read_number(words[2]);
+		swap_buffer(buf, from, len, off);
+		break;
+	}
+	close_buffer(&temp);
+	return 0;
+}
+
+// Applies every line of a script to the same buffer, one after the other, so each line's offsets are
+// of the data as the lines before it left it, just as if hexed had been run once per line.
+// Nothing is saved unless every line works, and then the file is replaced in one go
+int run_script(buffer *buf, buffer *script) {
+	if (!buf || is_empty(script)) return -1;
+	flatten_buffer(script);
+
+	buffer src = {0};
+	char *line = NULL;
+	int64_t pos = 0;
+	int n = 0, res = 0;
+	while (pos < script->size && res == 0) {
+		pos = read_line(script, pos, &line);
+		n++;
+
+		char *p = line;
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p || *p == '#') continue;
+
+		char *edit = strdup(p);
+		res = run_edit(buf, edit, &src);
+		free(edit);
+		if (res == -1) printf("Line %d of the script isn't a valid edit:\n%s\n", n, p);
+	}
+	free(line);
+	close_buffer(&src);
+	if (res < 0) {
+		printf("Nothing was saved\n");
+		return res;
+	}
+
+	// Only regular files can be replaced
+	struct stat st;
+	if (stat(buf->name, &st) < 0 || !S_ISREG(st.st_mode)) return save_buffer(buf);
+	if (replace_file(buf) < 0) {
+		printf("Could not write to \"%s\"\n", buf->name);
+		return -1;
+	}
+	return 0;
+}
+
+char *options = "nNwpifFcCrsSdvbmDx";
 // argument type requirements (used in reverse order)
 // one digit per argument (multiple digits per command)
 // 0 = end, 1 = string, 2 = input file, 3 = number, 4 = byte array
@@ -334,7 +1689,8 @@ char *options = "nNwpifFcCrsSdv";
 int arg_reqs[] = {
 	0xc1, 0xbb1, 0xbb32, 0x432, 0x432, // -n, -N, -w, -p, -i
 	0xb332, 0xb332, 0xbb232, 0xbb232, // -f, -F, -c, -C
-	0xb32, 0x42, 0x42, 0x922, 0xabb2 // -r, -s, -S, -d, -v
+	0xb32, 0x42, 0x42, 0x922, 0xabb2, // -r, -s, -S, -d, -v
+	0x42, 0x922, 0xb22, 0x22 // -b, -m, -D, -x
 };
 
 void close_args(void ***args_ref, int n_args, int mode) {
@@ -351,6 +1707,10 @@ void close_args(void ***args_ref, int n_args, int mode) {
 			free(args[i]);
 			args[i] = NULL;
 		}
+		else if (t == 3) {
+			free(args[i]);
+			args[i] = NULL;
+		}
 	}
 
 	free(args);
@@ -384,10 +1744,18 @@ char *usage_str = "Usage:\n"
 	"     <byte data...>\n"
 	"  -S: Search for byte array (optional replace)\n"
 	"     <byte data...>\n"
-	"  -d: Find differences in two files\n"
+	"  -d: Find runs of different bytes in two files\n"
 	"     <2nd input file> [output file of offsets]\n"
 	"  -v: Print/view data\n"
-	"     [offset] [size] [input file of offsets]\n";
+	"     [offset] [size] [input file of offsets]\n"
+	"  -b: Benchmark searching for byte array\n"
+	"     <byte data...>\n"
+	"  -m: Search for many byte arrays at once, ?? or ? matching any byte or nibble\n"
+	"     <pattern file> [output file of offsets]\n"
+	"  -D: Find inserted, removed and changed regions in two files\n"
+	"     <2nd input file> [block size]\n"
+	"  -x: Apply a script of edits, one per line (eg. \"p 0x10 de ad\"), then save once\n"
+	"     <script file>\n";
 
 int main(int argc, char **argv) {
 	if (argc < 3) {
@@ -440,11 +1808,10 @@ int main(int argc, char **argv) {
 			}
 		}
 		else if (a == 3) {
-			int n = memcmp(argv[i+2], "0x", 2) ?
-				atoi(argv[i+2]) : strtol(argv[i+2], NULL, 16);
-			// Fancy way of saying args[n_args] = n, but should be platform independent
-			args[n_args] = NULL;
-			memcpy(&args[n_args], &n, sizeof(int));
+			// Offsets and sizes can be past 4GB, so numbers don't fit in the pointer itself on every platform
+			int64_t *n = malloc(sizeof(int64_t));
+			*n = read_number(argv[i+2]);
+			args[n_args] = n;
 		}
 		else if (a == 4) {
 			args[n_args] = calloc(1, sizeof(buffer));
@@ -458,7 +1825,7 @@ int main(int argc, char **argv) {
 	buffer *buf = NULL, temp = {0}, replace = {0};
 	char *ptr = NULL;
 	u8 byte = 0;
-	int off = 0, len = 0, sz, *res = NULL;
+	int64_t off = 0, len = 0, sz;
 
 	switch (mode) {
 	case 0: // Create new file with byte array
@@ -469,60 +1836,60 @@ int main(int argc, char **argv) {
 		break;
 
 	case 1: // Create file with fill
-		if (n_args > 2) byte = *((u8*)&args[2]);
-		if (n_args > 1) create_filler(&temp, byte, *((int*)&args[1]));
+		if (n_args > 2) byte = (u8)*((int64_t*)args[2]);
+		if (n_args > 1) create_filler(&temp, byte, *((int64_t*)args[1]));
 		temp.name = strdup(args[0]);
 		save_buffer(&temp);
 		break;
 
 	case 2: // Swap bytes of data
-		if (n_args > 3) len = *((int*)&args[3]);
-		if (n_args > 2) off = *((int*)&args[2]);
-		swap_buffer(args[0], off, len, *((int*)&args[1]));
+		if (n_args > 3) len = *((int64_t*)args[3]);
+		if (n_args > 2) off = *((int64_t*)args[2]);
+		swap_buffer(args[0], off, len, *((int64_t*)args[1]));
 		save_buffer(args[0]);
 		break;
 		
 	case 3: // Replace data
-		apply_buffer(args[0], args[2], *((int*)&args[1]), 0, 0, 0);
+		apply_buffer(args[0], args[2], *((int64_t*)args[1]), 0, 0, 0);
 		save_buffer(args[0]);
 		break;
 
 	case 4: // Insert data
-		apply_buffer(args[0], args[2], *((int*)&args[1]), 0, 0, 1);
+		apply_buffer(args[0], args[2], *((int64_t*)args[1]), 0, 0, 1);
 		save_buffer(args[0]);
 		break;
 
 	case 5: // Fill (pave over) data
-		if (n_args > 3) byte = *((u8*)&args[3]);
-		create_filler(&temp, byte, *((int*)&args[2]));
-		apply_buffer(args[0], &temp, *((int*)&args[1]), 0, 0, 0);
+		if (n_args > 3) byte = (u8)*((int64_t*)args[3]);
+		create_filler(&temp, byte, *((int64_t*)args[2]));
+		apply_buffer(args[0], &temp, *((int64_t*)args[1]), 0, 0, 0);
 		save_buffer(args[0]);
 		break;
 
 	case 6: // Fill (insert into) data
-		if (n_args > 3) byte = *((u8*)&args[3]);
-		create_filler(&temp, byte, *((int*)&args[2]));
-		apply_buffer(args[0], &temp, *((int*)&args[1]), 0, 0, 1);
+		if (n_args > 3) byte = (u8)*((int64_t*)args[3]);
+		create_filler(&temp, byte, *((int64_t*)args[2]));
+		apply_buffer(args[0], &temp, *((int64_t*)args[1]), 0, 0, 1);
 		save_buffer(args[0]);
 		break;
 
 	case 7: // Copy (pave over) data
-		if (n_args > 4) len = *((int*)&args[4]);
-		if (n_args > 3) off = *((int*)&args[3]);
-		apply_buffer(args[0], args[2], *((int*)&args[1]), off, len, 0);
+		if (n_args > 4) len = *((int64_t*)args[4]);
+		if (n_args > 3) off = *((int64_t*)args[3]);
+		apply_buffer(args[0], args[2], *((int64_t*)args[1]), off, len, 0);
 		save_buffer(args[0]);
 		break;
 
 	case 8: // Copy (insert into) data
-		if (n_args > 4) len = *((int*)&args[4]);
-		if (n_args > 3) off = *((int*)&args[3]);
-		apply_buffer(args[0], args[2], *((int*)&args[1]), off, len, 1);
+		if (n_args > 4) len = *((int64_t*)args[4]);
+		if (n_args > 3) off = *((int64_t*)args[3]);
+		apply_buffer(args[0], args[2], *((int64_t*)args[1]), off, len, 1);
 		save_buffer(args[0]);
 		break;
 
 	case 9: // Remove data from file
-		if (n_args > 2) len = *((int*)&args[2]);
-		remove_buffer(args[0], *((int*)&args[1]), len);
+		if (n_args > 2) len = *((int64_t*)args[2]);
+		remove_buffer(args[0], *((int64_t*)args[1]), len);
 		save_buffer(args[0]);
 		break;
 
@@ -557,17 +1924,27 @@ int main(int argc, char **argv) {
 			if (c != 'Y' && c != 'y') break;
 		}
 
-		len = replace.size - sz;
-		for (i = 0, ptr = temp.data; ptr < (char*)(temp.data + temp.size); i++, ptr += sizeof(int)) {
-			off = *((int*)ptr) + (i * len);
-			remove_buffer(args[0], off, sz);
-			apply_buffer(args[0], &replace, off, 0, 0, 1);
-		}
-		save_buffer(args[0]);
+		replace_results(args[0], &temp, sz, &replace);
 		break;
 
 	case 12: // Find differences in two files
 		diff_buffer(&temp, args[0], args[1]);
+		if (temp.size && n_args > 2) save_runs(&temp, args[2]);
+		break;
+
+	case 13: // View part of or the whole file
+		if (n_args > 1) off = *((int64_t*)args[1]);
+		if (n_args > 2) len = *((int64_t*)args[2]);
+		if (n_args > 3) buf = args[3];
+		view_buffer(args[0], off, len, buf);
+		break;
+
+	case 14: // Benchmark search methods
+		bench_search(args[0], args[1]);
+		break;
+
+	case 15: // Search data for every pattern in a file
+		search_patterns(&temp, args[0], args[1]);
 		if (!temp.size) break;
 
 		if (n_args > 2) {
@@ -576,11 +1953,13 @@ int main(int argc, char **argv) {
 		}
 		break;
 
-	case 13: // View part of or the whole file
-		if (n_args > 1) off = *((int*)&args[1]);
-		if (n_args > 2) len = *((int*)&args[2]);
-		if (n_args > 3) buf = args[3];
-		view_buffer(args[0], off, len, buf);
+	case 16: // Find inserted, removed and changed regions
+		if (n_args > 2) len = *((int64_t*)args[2]);
+		diff_blocks(args[0], args[1], len);
+		break;
+
+	case 17: // Apply a script of edits
+		run_script(args[0], args[1]);
 		break;
 	}
 